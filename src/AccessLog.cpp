@@ -0,0 +1,79 @@
+/*
+ * AccessLog.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "AccessLog.h"
+#include <fstream>
+#include "easylogging++.h"
+
+#define LOCK_LOG std::lock_guard<std::mutex> l(m_mutex)
+
+static const size_t PREFETCH_WINDOW = 16; // learned pieces prioritized ahead of the reader
+static const int PREFETCH_PRIORITY = 5; // below the pieces being read (7) and read-ahead (6)
+static const size_t MAX_PIECES = 65536; // keeps the log of a huge file bounded
+
+AccessLog::AccessLog(const std::string& path, int first_piece, int last_piece) :
+        m_path(path), m_first_piece(first_piece) {
+    std::ifstream in(m_path);
+    int piece;
+    while (in >> piece && m_learned.size() < MAX_PIECES) {
+        if (piece >= 0 && piece <= last_piece - first_piece && m_position.emplace(piece, m_learned.size()).second) {
+            m_learned.push_back(piece);
+        }
+    }
+    if (!m_learned.empty()) {
+        VLOG(1) << "Loaded access order of " << m_learned.size() << " pieces from " << m_path;
+    }
+}
+
+void AccessLog::prefetch(const libtorrent::torrent_handle& handle, size_t until) {
+    for (; m_prefetched < std::min(until, m_learned.size()); ++m_prefetched) {
+        int piece = m_first_piece + m_learned[m_prefetched];
+        if (!handle.have_piece(piece) && handle.piece_priority(piece) < PREFETCH_PRIORITY) {
+            handle.piece_priority(piece, PREFETCH_PRIORITY);
+        }
+    }
+}
+
+void AccessLog::start(const libtorrent::torrent_handle& handle) {
+    LOCK_LOG;
+    prefetch(handle, PREFETCH_WINDOW);
+}
+
+void AccessLog::record(const libtorrent::torrent_handle& handle, int piece) {
+    LOCK_LOG;
+    piece -= m_first_piece;
+    if (m_order.size() < MAX_PIECES && m_seen.insert(piece).second) {
+        m_order.push_back(piece);
+        m_dirty = true;
+    }
+    auto pos = m_position.find(piece);
+    if (pos != m_position.end()) {
+        prefetch(handle, pos->second + 1 + PREFETCH_WINDOW);
+    }
+}
+
+void AccessLog::save() {
+    LOCK_LOG;
+    if (!m_dirty) {
+        return;
+    }
+    // this run first, then whatever the previous runs read and this one didn't get to
+    std::ofstream out(m_path, std::ios::trunc);
+    size_t count = 0;
+    for (int piece : m_order) {
+        out << piece << (++count % 16 ? ' ' : '\n');
+    }
+    for (int piece : m_learned) {
+        if (count < MAX_PIECES && !m_seen.count(piece)) {
+            out << piece << (++count % 16 ? ' ' : '\n');
+        }
+    }
+    if (!out) {
+        LOG(WARNING)<< "Couldn't save access order to " << m_path;
+    }
+    m_dirty = false;
+}
@@ -0,0 +1,45 @@
+/*
+ * AccessLog.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <libtorrent/torrent_handle.hpp>
+
+/*
+ * Order in which the pieces of a file are first read. It's saved when the file
+ * is released and replayed on the next run: the pieces that previous readers
+ * needed next are prioritized a window ahead of the current reader, so files
+ * read in the same non-sequential order every time (archives with an index at
+ * the end, database snapshots) don't wait for every piece on demand.
+ */
+class AccessLog {
+public:
+    AccessLog(const std::string& path, int first_piece, int last_piece);
+    AccessLog(const AccessLog& o) = delete;
+    void start(const libtorrent::torrent_handle& handle);
+    void record(const libtorrent::torrent_handle& handle, int piece);
+    void save();
+private:
+    std::mutex m_mutex;
+    std::string m_path;
+    int m_first_piece;
+    std::vector<int> m_learned; // pieces relative to the first one in the order of the previous runs
+    std::unordered_map<int, size_t> m_position; // piece -> position in m_learned
+    size_t m_prefetched = 0; // learned pieces before this position have been prioritized
+    std::vector<int> m_order; // this run
+    std::unordered_set<int> m_seen;
+    bool m_dirty = false;
+    void prefetch(const libtorrent::torrent_handle& handle, size_t until);
+};
+
+#endif /* ACCESSLOG_H_ */
@@ -0,0 +1,222 @@
+/*
+ * Control.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "Control.h"
+#include <sstream>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "Session.h"
+#include "easylogging++.h"
+
+Control::Control(Session& session, const std::string& path) :
+        m_session(session), m_path(path) {
+}
+
+void Control::start() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Control socket path is too long: " + m_path);
+    }
+    strcpy(addr.sun_path, m_path.c_str());
+
+    if (pipe(m_wake_pipe)) {
+        throw std::runtime_error(std::string("Failed to create control pipe: ") + strerror(errno));
+    }
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+        throw std::runtime_error(std::string("Failed to create control socket: ") + strerror(errno));
+    }
+    fcntl(m_listen_fd, F_SETFD, FD_CLOEXEC);
+    struct stat st;
+    if (!lstat(m_path.c_str(), &st) && S_ISSOCK(st.st_mode)) { // left over from a previous run
+        unlink(m_path.c_str());
+    }
+    if (bind(m_listen_fd, (sockaddr*) &addr, sizeof(addr)) || listen(m_listen_fd, 4)) {
+        throw std::runtime_error("Failed to listen on " + m_path + ": " + strerror(errno));
+    }
+    VLOG(1) << "Control socket listening on " << m_path;
+    m_thread = std::make_unique<std::thread>(&Control::loop, this);
+}
+
+void Control::stop() {
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    m_session.interrupt_fetches(); // an "add" of a slow URL would hold the thread
+    if (m_wake_pipe[1] >= 0) {
+        char c = 0;
+        if (write(m_wake_pipe[1], &c, 1) < 0) {
+            LOG(WARNING)<< "Couldn't wake control thread: " << strerror(errno);
+        }
+    }
+    if (m_thread && m_thread->joinable()) {
+        m_thread->join();
+    }
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+    for (int fd : m_wake_pipe) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void Control::loop() {
+    std::map<int, std::string> clients; // connection -> incomplete command
+    while (!m_stop) {
+        // all clients are polled together so one idle connection doesn't block the others
+        std::vector<pollfd> fds { { m_listen_fd, POLLIN, 0 }, { m_wake_pipe[0], POLLIN, 0 } };
+        for (auto& c : clients) {
+            fds.push_back( { c.first, POLLIN, 0 });
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(WARNING)<< "Control socket poll failed: " << strerror(errno);
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents && !serve(fds[i].fd, clients[fds[i].fd])) {
+                close(fds[i].fd);
+                clients.erase(fds[i].fd);
+            }
+        }
+        if (fds[0].revents) {
+#ifdef HAVE_ACCEPT4
+            int fd = accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+            int fd = accept(m_listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+#endif
+            if (fd >= 0) {
+                clients.emplace(fd, std::string());
+            }
+        }
+    }
+    for (auto& c : clients) {
+        close(c.first);
+    }
+}
+
+bool Control::serve(int fd, std::string& pending) {
+    char buf[4096];
+    ssize_t len = ::read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+        return false;
+    }
+    pending.append(buf, (size_t) len);
+    size_t eol;
+    while ((eol = pending.find('\n')) != std::string::npos) {
+        std::string reply = execute(pending.substr(0, eol)) + "\n";
+        pending.erase(0, eol + 1);
+        if (::write(fd, reply.data(), reply.size()) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string Control::execute(const std::string& line) {
+    std::istringstream in(line);
+    std::string cmd;
+    in >> cmd;
+    VLOG(1) << "Control command: " << line;
+    try {
+        if (cmd == "add") {
+            std::string metadata;
+            std::getline(in >> std::ws, metadata);
+            if (metadata.empty()) {
+                return "ERR metadata expected";
+            }
+            return "OK " + m_session.add_torrent(metadata);
+        }
+        if (cmd == "remove") {
+            std::string hash;
+            in >> hash;
+            return m_session.remove_torrent(hash) ? "OK" : "ERR no such torrent";
+        }
+        if (cmd == "rate") {
+            int download, upload;
+            if (!(in >> download >> upload) || download < 0 || upload < 0) {
+                return "ERR usage: rate <download kB/s> <upload kB/s>";
+            }
+            m_session.set_rate_limits(download, upload);
+            return "OK";
+        }
+        if (cmd == "torrent-rate") {
+            std::string hash;
+            int download, upload;
+            if (!(in >> hash >> download >> upload) || download < 0 || upload < 0) {
+                return "ERR usage: torrent-rate <info-hash> <download kB/s> <upload kB/s>";
+            }
+            auto t = m_session.find_torrent(hash);
+            if (!t) {
+                return "ERR no such torrent";
+            }
+            t->set_rate_limits(download, upload);
+            return "OK";
+        }
+        if (cmd == "priority") {
+            std::string hash;
+            int priority;
+            if (!(in >> hash >> priority) || priority < 0 || priority > 7) {
+                return "ERR usage: priority <info-hash> <0-7>";
+            }
+            auto t = m_session.find_torrent(hash);
+            if (!t) {
+                return "ERR no such torrent";
+            }
+            t->set_priority(priority);
+            return "OK";
+        }
+        if (cmd == "mirror") {
+            std::string hash, url;
+            if (!(in >> hash >> url)) {
+                return "ERR usage: mirror <info-hash> <url>";
+            }
+            auto t = m_session.find_torrent(hash);
+            if (!t) {
+                return "ERR no such torrent";
+            }
+            t->add_web_seed(url);
+            return "OK";
+        }
+        if (cmd == "stats") {
+            return "OK " + m_session.stats();
+        }
+        if (cmd == "list") {
+            std::ostringstream out;
+            for (auto& t : m_session.get_torrents()) {
+                out << t->info_hash() << ' ' << t->name() << '\n';
+            }
+            out << "OK";
+            return out.str();
+        }
+    } catch (const std::exception& e) {
+        return std::string("ERR ") + e.what();
+    }
+    return "ERR unknown command '" + cmd + "'";
+}
+
+Control::~Control() {
+    stop();
+}
@@ -0,0 +1,52 @@
+/*
+ * Control.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <memory>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+
+class Session;
+
+/*
+ * Line based control interface on a Unix socket. Every command is answered with
+ * a single line starting with "OK" or "ERR", except "list" which prints one line
+ * per torrent before the final "OK".
+ *
+ *   add <metadata>                       add a .torrent file, URL or magnet link
+ *   remove <info-hash>                   remove a torrent and its mount entries
+ *   rate <download kB/s> <upload kB/s>   change the session rate limits (0 = unlimited)
+ *   torrent-rate <info-hash> <down> <up> change the rate limits of a single torrent
+ *   priority <info-hash> <0-7>           background download priority of all files
+ *   mirror <info-hash> <url>             add an HTTP mirror (web seed) of the torrent's data
+ *   list                                 print info-hash and name of every torrent
+ *   stats                                bytes of piece reads in flight, their peak and peak RSS
+ */
+class Control {
+public:
+    Control(Session& session, const std::string& path);
+    Control(const Control& o) = delete;
+    void start();
+    void stop();
+    ~Control();
+private:
+    Session& m_session;
+    std::string m_path;
+    int m_listen_fd = -1;
+    int m_wake_pipe[2] = { -1, -1 };
+    std::atomic<bool> m_stop { false };
+    std::unique_ptr<std::thread> m_thread;
+    void loop();
+    bool serve(int fd, std::string& pending);
+    std::string execute(const std::string& line);
+};
+
+#endif /* CONTROL_H_ */
@@ -0,0 +1,321 @@
+/*
+ * Importer.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "Importer.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#include <boost/filesystem.hpp>
+#include <libtorrent/entry.hpp>
+#include <libtorrent/bencode.hpp>
+#include <libtorrent/hasher.hpp>
+#include "easylogging++.h"
+
+namespace fs = boost::filesystem;
+
+static const size_t COPY_CHUNK = 4 * 1024 * 1024; // stop() is noticed between chunks
+
+Importer::Importer(const std::string& dir) :
+        m_dir(dir) {
+    for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i) {
+        m_hashers.emplace_back(&Importer::hash_loop, this);
+    }
+}
+
+Importer::~Importer() {
+    stop();
+}
+
+void Importer::import(libtorrent::add_torrent_params params, Handler handler) {
+    std::lock_guard<std::mutex> l(m_mutex);
+    if (m_stop) {
+        return;
+    }
+    for (auto it = m_running.begin(); it != m_running.end();) {
+        if (it->m_done) { // its thread has nothing left to do but return
+            it->m_thread.join();
+            it = m_running.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_running.emplace_back();
+    auto& running = m_running.back();
+    running.m_thread = std::thread([this, &running, params, handler]() mutable {
+        try {
+            params.resume_data = import_files(*params.ti, params.save_path);
+        } catch (const std::exception& e) {
+            LOG(WARNING)<< "Import of " << params.ti->name() << " failed: " << e.what();
+        }
+        handler(params);
+        std::lock_guard<std::mutex> l(m_mutex);
+        running.m_done = true;
+    });
+}
+
+void Importer::stop() {
+    {
+        std::lock_guard<std::mutex> l(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+        m_signal.notify_all();
+        m_checked.notify_all();
+    }
+    // nothing is added to the lists anymore
+    for (auto& r : m_running) {
+        r.m_thread.join();
+    }
+    for (auto& t : m_hashers) {
+        t.join();
+    }
+}
+
+bool Importer::stopped() {
+    std::lock_guard<std::mutex> l(m_mutex);
+    return m_stop;
+}
+
+void Importer::hash_loop() {
+    std::vector<char> buf;
+    std::unique_lock<std::mutex> l(m_mutex);
+    for (;;) {
+        m_signal.wait(l, [this] {
+            return m_stop || !m_verifying.empty();
+        });
+        if (m_stop) {
+            return;
+        }
+        auto v = m_verifying.front();
+        m_verifying.pop_front();
+        int piece = v->m_pieces[v->m_next++];
+        if (v->m_next < v->m_pieces.size()) { // imports take turns
+            m_verifying.push_back(v);
+        }
+        l.unlock();
+        bool ok = check_piece(*v, piece, buf);
+        l.lock();
+        v->m_verified[piece] = ok;
+        if (++v->m_done == v->m_pieces.size()) {
+            m_checked.notify_all();
+        }
+    }
+}
+
+bool Importer::check_piece(const Verification& v, int piece, std::vector<char>& buf) {
+    auto& ti = *v.m_ti;
+    buf.resize((size_t) ti.piece_size(piece));
+    char* out = buf.data();
+    for (auto& s : ti.map_block(piece, 0, ti.piece_size(piece))) {
+        if (ti.files().pad_file_at(s.file_index)) {
+            memset(out, 0, (size_t) s.size);
+        } else if (pread(v.m_fds[s.file_index], out, (size_t) s.size, s.offset) != s.size) {
+            return false;
+        }
+        out += s.size;
+    }
+    return libtorrent::hasher(buf.data(), ti.piece_size(piece)).final() == ti.hash_for_piece(piece);
+}
+
+void Importer::build_index() {
+    boost::system::error_code ec;
+    for (fs::recursive_directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!fs::is_regular_file(it->status())) {
+            continue;
+        }
+        auto size = fs::file_size(it->path(), ec);
+        if (ec) {
+            ec.clear();
+            continue;
+        }
+        m_index.emplace(it->path().filename().string() + "/" + std::to_string(size), it->path().string());
+    }
+    m_indexed = true;
+    VLOG(1) << "Indexed " << m_index.size() << " files in " << m_dir;
+}
+
+std::string Importer::find(const libtorrent::file_storage& files, int index) {
+    boost::system::error_code ec;
+    auto size = (boost::uintmax_t) files.file_size(index);
+    // the same layout as in the torrent is the best match
+    fs::path same(m_dir + "/" + files.file_path(index));
+    if (fs::is_regular_file(same, ec) && fs::file_size(same, ec) == size) {
+        return same.string();
+    }
+    std::lock_guard<std::mutex> l(m_index_mutex);
+    if (!m_indexed) {
+        build_index();
+    }
+    auto r = m_index.equal_range(files.file_name(index) + "/" + std::to_string(size));
+    return r.first != r.second ? r.first->second : "";
+}
+
+bool Importer::copy(const std::string& from, const std::string& to) {
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return false;
+    }
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return false;
+    }
+    std::vector<char> buf(COPY_CHUNK);
+    ssize_t len;
+    bool ok = true;
+    while (ok && (len = ::read(src, buf.data(), buf.size())) > 0) {
+        ok = !stopped() && write(dst, buf.data(), (size_t) len) == len;
+    }
+    ok = ok && !len;
+    close(src);
+    close(dst);
+    if (!ok) {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+
+Importer::Placed Importer::place(const std::string& from, const std::string& to) {
+    boost::system::error_code ec;
+    if (fs::exists(to, ec)) {
+        return Placed::EXISTING;
+    }
+    fs::create_directories(fs::path(to).parent_path(), ec);
+#ifdef FICLONE
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src >= 0) {
+        int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (dst >= 0) {
+            bool cloned = ioctl(dst, FICLONE, src) == 0;
+            close(dst);
+            if (cloned) {
+                close(src);
+                return Placed::REFLINK;
+            }
+            unlink(to.c_str());
+        }
+        close(src);
+    }
+#endif
+    if (!link(from.c_str(), to.c_str())) {
+        return Placed::HARDLINK;
+    }
+    if (copy(from, to)) {
+        return Placed::COPY;
+    }
+    if (!stopped()) {
+        LOG(WARNING)<< "Couldn't import " << from << ": " << strerror(errno);
+    }
+    return Placed::NONE;
+}
+
+std::vector<bool> Importer::verify(const libtorrent::torrent_info& ti, const std::string& save_path,
+        const std::vector<Placed>& placed) {
+    auto& files = ti.files();
+    auto v = std::make_shared<Verification>();
+    v->m_ti = &ti;
+    v->m_fds.assign(files.num_files(), -1);
+    v->m_verified.assign(ti.num_pieces(), 0);
+    for (int i = 0; i < files.num_files(); ++i) {
+        if (placed[i] != Placed::NONE) {
+            v->m_fds[i] = open((save_path + "/" + files.file_path(i)).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+    }
+    for (int p = 0; p < ti.num_pieces(); ++p) {
+        auto slices = ti.map_block(p, 0, ti.piece_size(p));
+        if (std::all_of(slices.begin(), slices.end(), [&](const libtorrent::file_slice& s) {
+            return files.pad_file_at(s.file_index) || v->m_fds[s.file_index] >= 0;
+        })) {
+            v->m_pieces.push_back(p);
+        }
+    }
+    if (!v->m_pieces.empty()) {
+        std::unique_lock<std::mutex> l(m_mutex);
+        m_verifying.push_back(v);
+        m_signal.notify_all();
+        m_checked.wait(l, [this, &v] {
+            return m_stop || v->m_done == v->m_pieces.size();
+        });
+        // the hashers drop everything on stop, the pieces left count as missing
+        m_verifying.erase(std::remove(m_verifying.begin(), m_verifying.end(), v), m_verifying.end());
+        while (v->m_done < v->m_next) { // don't close the files under a hasher
+            m_checked.wait_for(l, std::chrono::milliseconds(10));
+        }
+    }
+    for (int fd : v->m_fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return std::vector<bool>(v->m_verified.begin(), v->m_verified.end());
+}
+
+std::vector<char> Importer::import_files(const libtorrent::torrent_info& ti, const std::string& save_path) {
+    auto& files = ti.files();
+    std::vector<Placed> placed(files.num_files(), Placed::NONE);
+    std::vector<std::string> sources(files.num_files());
+    int count = 0;
+    for (int i = 0; i < files.num_files() && !stopped(); ++i) {
+        if (files.pad_file_at(i) || (sources[i] = find(files, i)).empty()) {
+            continue;
+        }
+        placed[i] = place(sources[i], save_path + "/" + files.file_path(i));
+        if (placed[i] != Placed::NONE) {
+            VLOG(1) << "Importing " << files.file_path(i) << " from " << sources[i];
+            ++count;
+        }
+    }
+    if (!count) {
+        return std::vector<char>();
+    }
+    auto verified = verify(ti, save_path, placed);
+    for (int i = 0; i < files.num_files(); ++i) {
+        if (placed[i] != Placed::HARDLINK || !files.file_size(i)) {
+            continue;
+        }
+        // libtorrent would write the missing pieces through the link into the original file
+        int first = (int) (files.file_offset(i) / ti.piece_length());
+        int last = (int) ((files.file_offset(i) + files.file_size(i) - 1) / ti.piece_length());
+        if (std::find(verified.begin() + first, verified.begin() + last + 1, false) != verified.begin() + last + 1) {
+            std::string to = save_path + "/" + files.file_path(i);
+            unlink(to.c_str());
+            copy(sources[i], to); // a link mustn't stay even if this is interrupted
+        }
+    }
+    int have = (int) std::count(verified.begin(), verified.end(), true);
+    LOG(INFO)<< "Imported " << count << " files of " << ti.name() << ", " << have << " of " << ti.num_pieces()
+            << " pieces verified";
+
+    libtorrent::entry rd(libtorrent::entry::dictionary_t);
+    rd["file-format"] = "libtorrent resume file";
+    rd["file-version"] = 1;
+    rd["info-hash"] = ti.info_hash().to_string();
+    std::string pieces(verified.size(), 0);
+    for (size_t p = 0; p < verified.size(); ++p) {
+        pieces[p] = verified[p] ? 1 : 0;
+    }
+    rd["pieces"] = pieces;
+    auto& sizes = rd["file sizes"].list();
+    for (int i = 0; i < files.num_files(); ++i) {
+        struct stat st;
+        libtorrent::entry size(libtorrent::entry::list_t);
+        bool exists = !stat((save_path + "/" + files.file_path(i)).c_str(), &st);
+        size.list().push_back(libtorrent::entry(exists ? (boost::int64_t) st.st_size : 0));
+        size.list().push_back(libtorrent::entry(exists ? (boost::int64_t) st.st_mtime : 0));
+        sizes.push_back(size);
+    }
+    std::vector<char> result;
+    libtorrent::bencode(std::back_inserter(result), rd);
+    return result;
+}
@@ -0,0 +1,81 @@
+/*
+ * Importer.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef IMPORTER_H_
+#define IMPORTER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <libtorrent/add_torrent_params.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+/*
+ * Reuses local copies of torrent data. Files under the import directory that
+ * match a torrent file by name and size are reflinked, hardlinked or copied into
+ * the save path, then the pieces they fully cover are hash-checked on a pool of
+ * one thread per core shared by all imports. Verified pieces are passed to
+ * libtorrent as resume data so it starts with them and doesn't check them again.
+ * Every import runs on a thread of its own, stop() interrupts them between
+ * copied chunks and checked pieces.
+ */
+class Importer {
+public:
+    typedef std::function<void(libtorrent::add_torrent_params& params)> Handler;
+    Importer(const std::string& dir);
+    Importer(const Importer& o) = delete;
+    ~Importer();
+    // handler gets params with the resume data set once the import is done or interrupted by stop()
+    void import(libtorrent::add_torrent_params params, Handler handler);
+    void stop();
+private:
+    enum class Placed {
+        NONE, EXISTING, REFLINK, HARDLINK, COPY
+    };
+    struct Running {
+        std::thread m_thread;
+        bool m_done = false;
+    };
+    struct Verification {
+        const libtorrent::torrent_info* m_ti;
+        std::vector<int> m_fds; // file index -> descriptor of the placed file or -1
+        std::vector<int> m_pieces; // candidates, covered by placed files only
+        size_t m_next = 0;
+        size_t m_done = 0;
+        std::vector<char> m_verified; // piece -> passed the hash check
+    };
+    std::mutex m_mutex;
+    std::condition_variable m_signal; // hashers wait for work here
+    std::condition_variable m_checked; // imports wait for their pieces here
+    bool m_stop = false;
+    std::list<Running> m_running;
+    std::vector<std::thread> m_hashers;
+    std::deque<std::shared_ptr<Verification>> m_verifying;
+    std::mutex m_index_mutex;
+    std::string m_dir;
+    bool m_indexed = false;
+    std::unordered_multimap<std::string, std::string> m_index; // name + '/' + size -> path
+    bool stopped();
+    void hash_loop();
+    bool check_piece(const Verification& v, int piece, std::vector<char>& buf);
+    std::vector<char> import_files(const libtorrent::torrent_info& ti, const std::string& save_path);
+    void build_index();
+    std::string find(const libtorrent::file_storage& fs, int index);
+    Placed place(const std::string& from, const std::string& to);
+    bool copy(const std::string& from, const std::string& to);
+    std::vector<bool> verify(const libtorrent::torrent_info& ti, const std::string& save_path,
+            const std::vector<Placed>& placed);
+};
+
+#endif /* IMPORTER_H_ */
@@ -0,0 +1,73 @@
+/*
+ * MappedFile.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "MappedFile.h"
+#include <mutex>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "easylogging++.h"
+
+MappedFile::MappedFile(const std::string& path) :
+        m_path(path) {
+}
+
+bool MappedFile::remap(size_t size) {
+    std::unique_lock<std::shared_timed_mutex> l(m_mutex);
+    if (m_size >= size) { // another reader has done it already
+        return true;
+    }
+    if (m_fd < 0) {
+        m_fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0) {
+            return false;
+        }
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) || (size_t) st.st_size < size) {
+        return false;
+    }
+    void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED) {
+        LOG(WARNING)<< "Couldn't map " << m_path << ": " << strerror(errno);
+        return false;
+    }
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+    m_data = (char*) data;
+    m_size = (size_t) st.st_size;
+    return true;
+}
+
+bool MappedFile::copy(char *buf, int64_t offset, size_t size) {
+    size_t end = (size_t) offset + size;
+    {
+        std::shared_lock<std::shared_timed_mutex> l(m_mutex);
+        if (end <= m_size) {
+            memcpy(buf, m_data + offset, size);
+            return true;
+        }
+    }
+    if (!remap(end)) {
+        return false;
+    }
+    std::shared_lock<std::shared_timed_mutex> l(m_mutex);
+    memcpy(buf, m_data + offset, size);
+    return true;
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * MappedFile.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <string>
+#include <cstdint>
+#include <shared_mutex>
+
+/*
+ * Read-only shared mapping of a file libtorrent is downloading into. The file
+ * may still grow, the mapping is extended when a read goes past its end.
+ */
+class MappedFile {
+public:
+    MappedFile(const std::string& path);
+    MappedFile(const MappedFile& o) = delete;
+    bool copy(char *buf, int64_t offset, size_t size); // false if the range isn't on disk yet
+    ~MappedFile();
+private:
+    std::shared_timed_mutex m_mutex;
+    std::string m_path;
+    int m_fd = -1;
+    char* m_data = nullptr;
+    size_t m_size = 0;
+    bool remap(size_t size);
+};
+
+#endif /* MAPPEDFILE_H_ */
@@ -0,0 +1,128 @@
+/*
+ * ReadBudget.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "ReadBudget.h"
+#include <sstream>
+#include <sys/resource.h>
+#include "easylogging++.h"
+
+#define LOCK_BUDGET std::lock_guard<std::mutex> l(m_mutex)
+
+static const auto READ_TIMEOUT = std::chrono::seconds(15); // the read_piece_alert is considered lost after that
+
+ReadBudget::ReadBudget(btfs_params& params) :
+        m_params(params) {
+}
+
+void ReadBudget::issue(const PieceKey& key, int size) {
+    try {
+        key.first.read_piece(key.second);
+    } catch (const std::exception& e) { // the torrent has been removed meanwhile
+        LOG(WARNING)<< "Couldn't read piece " << key.second << ": " << e.what();
+        return;
+    }
+    m_issued.emplace(key, Issued { size, std::chrono::steady_clock::now() });
+    m_inflight += (size_t) size;
+    if (m_inflight > m_peak) {
+        m_peak = m_inflight;
+    }
+}
+
+void ReadBudget::drain() {
+    size_t limit = (size_t) m_params.max_inflight * 1024 * 1024;
+    while (!m_queue.empty()) {
+        auto q = m_queued.find(m_queue.front());
+        if (q == m_queued.end()) { // forgotten
+            m_queue.pop_front();
+            continue;
+        }
+        // a single piece bigger than the limit still goes through when nothing else is in flight
+        if (m_inflight && m_inflight + (size_t) q->second > limit) {
+            return;
+        }
+        issue(q->first, q->second);
+        m_queued.erase(q);
+        m_queue.pop_front();
+    }
+}
+
+void ReadBudget::request(const libtorrent::torrent_handle& handle, int piece, int size) {
+    LOCK_BUDGET;
+    PieceKey key(handle, piece);
+    if (m_issued.count(key) || m_queued.count(key)) {
+        return;
+    }
+    m_queued.emplace(key, size);
+    m_queue.push_back(key);
+    drain();
+}
+
+void ReadBudget::complete(const libtorrent::torrent_handle& handle, int piece) {
+    LOCK_BUDGET;
+    auto i = m_issued.find(PieceKey(handle, piece));
+    if (i == m_issued.end()) {
+        return;
+    }
+    m_inflight -= (size_t) i->second.m_size;
+    m_issued.erase(i);
+    drain();
+}
+
+void ReadBudget::forget(const libtorrent::torrent_handle& handle) {
+    LOCK_BUDGET;
+    for (auto i = m_issued.begin(); i != m_issued.end();) {
+        if (i->first.first == handle) {
+            m_inflight -= (size_t) i->second.m_size;
+            i = m_issued.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    for (auto i = m_queued.begin(); i != m_queued.end();) {
+        if (i->first.first == handle) {
+            i = m_queued.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    drain();
+}
+
+void ReadBudget::expire() {
+    LOCK_BUDGET;
+    auto now = std::chrono::steady_clock::now();
+    for (auto i = m_issued.begin(); i != m_issued.end();) {
+        if (now - i->second.m_at < READ_TIMEOUT) {
+            ++i;
+            continue;
+        }
+        // the readers merged into this request would wait forever otherwise
+        LOG(WARNING)<< "Piece " << i->first.second << " wasn't read in time, requesting again";
+        try {
+            i->first.first.read_piece(i->first.second);
+            i->second.m_at = now;
+            ++i;
+        } catch (const std::exception& e) {
+            m_inflight -= (size_t) i->second.m_size;
+            i = m_issued.erase(i);
+        }
+    }
+    drain();
+}
+
+std::string ReadBudget::stats() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    usage.ru_maxrss /= 1024; // bytes there, kilobytes on Linux
+#endif
+    LOCK_BUDGET;
+    std::ostringstream s;
+    s << "inflight_bytes=" << m_inflight << " peak_inflight_bytes=" << m_peak << " queued_reads=" << m_queued.size()
+            << " max_rss_kb=" << usage.ru_maxrss;
+    return s.str();
+}
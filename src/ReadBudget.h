@@ -0,0 +1,54 @@
+/*
+ * ReadBudget.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef READBUDGET_H_
+#define READBUDGET_H_
+
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <boost/unordered_map.hpp>
+#include <libtorrent/torrent_handle.hpp>
+#include "main.h"
+
+/*
+ * Admission control for read_piece() requests. Every request makes libtorrent
+ * allocate a whole piece and keep it in the alert queue, so the bytes of the
+ * requests in flight are capped. Requests over the cap wait in a FIFO queue and
+ * requests for a piece that is already being read are merged, the alert is
+ * delivered to all readers of the torrent anyway. libtorrent drops alerts when
+ * its queue is full, so requests unanswered for too long are issued again.
+ */
+class ReadBudget {
+public:
+    ReadBudget(btfs_params& params);
+    ReadBudget(const ReadBudget& o) = delete;
+    void request(const libtorrent::torrent_handle& handle, int piece, int size);
+    void complete(const libtorrent::torrent_handle& handle, int piece);
+    void forget(const libtorrent::torrent_handle& handle);
+    void expire();
+    std::string stats();
+private:
+    typedef std::pair<libtorrent::torrent_handle, int> PieceKey;
+    std::mutex m_mutex;
+    btfs_params& m_params;
+    size_t m_inflight = 0;
+    size_t m_peak = 0;
+    struct Issued {
+        int m_size;
+        std::chrono::steady_clock::time_point m_at;
+    };
+    boost::unordered_map<PieceKey, Issued> m_issued;
+    boost::unordered_map<PieceKey, int> m_queued;
+    std::deque<PieceKey> m_queue;
+    void issue(const PieceKey& key, int size);
+    void drain();
+};
+
+#endif /* READBUDGET_H_ */
@@ -8,18 +8,20 @@
 #include "ReadTask.h"
 #include <libtorrent/torrent_info.hpp>
 #include "easylogging++.h"
+#include "Trace.h"
 
 void ReadTask::prioritize(int piece_idx, int priority) {
     if (!m_handle.have_piece(piece_idx)) {
-        VLOG(3) << "Prioritizing piece " << piece_idx << " to " << priority;
         m_handle.piece_priority(piece_idx, priority);
     }
 }
 
-ReadTask::ReadTask(const libtorrent::torrent_handle& handle, char *buf, int index, off_t offset, size_t size) :
-        m_handle(handle) {
-    VLOG(2) << "New read index=" << index << " offset=" << offset << " size=" << size;
-    auto ti = m_handle.torrent_file();
+ReadTask::ReadTask(const libtorrent::torrent_handle& handle, ReadBudget& budget, MappedFile* file, char *buf, int index,
+        off_t offset, size_t size) :
+        m_handle(handle), m_budget(budget), m_file(file), m_ti(handle.torrent_file()) {
+    TRACE_SPAN(m_span, m_started);
+    TRACE(READ_BEGIN, m_span, index, size);
+    auto& ti = m_ti;
 
     int64_t file_size = ti->files().file_size(index);
 
@@ -30,10 +32,8 @@ ReadTask::ReadTask(const libtorrent::torrent_handle& handle, char *buf, int inde
 
         req.length = std::min(ti->piece_size(req.piece) - req.start, req.length);
 
-        VLOG(3) << "Adding piece " << req.piece << " len=" << req.length;
-        if (!m_pieces.emplace(req.piece, Piece { req, buf }).second) {
-            VLOG(3) << "Not adding piece " << req.piece << " len=" << req.length << " as it's already present";
-        }
+        TRACE(PIECE_WANTED, m_span, req.piece, req.length);
+        m_pieces.emplace(req.piece, Piece { req, buf, offset });
 
         size -= (size_t) req.length;
         offset += req.length;
@@ -56,20 +56,58 @@ int ReadTask::read() {
     try_read_all();
 
     std::unique_lock<std::mutex> lock(m_read_mutex);
-    m_cv.wait(lock, [this] { // wait for all pieces to download or fail, cv will be notified from the alert thread
-        return !m_piece_count || m_failed;
-    });
-
-    if (m_failed)
-        return -EIO;
-    else
-        return m_effective_size;
+    while (m_piece_count && !m_failed) {
+        m_cv.wait(lock, [this] { // wait for all pieces to download or fail, cv will be notified from the alert thread
+            return !m_piece_count || m_failed || !m_finished.empty();
+        });
+        // copying from the mapping may block on the disk, so it's done here and not on the alert thread
+        while (!m_finished.empty() && !m_failed) {
+            int piece_idx = m_finished.back();
+            m_finished.pop_back();
+            lock.unlock();
+            fetch(piece_idx, m_pieces.at(piece_idx));
+            lock.lock();
+        }
+    }
+
+    int result = m_failed ? -EIO : (int) m_effective_size;
+    TRACE(READ_END, m_span, result, Trace::now() - m_started);
+    return result;
+}
+
+void ReadTask::fetch(int piece_idx, Piece& piece) {
+    if (m_file) {
+        {
+            std::lock_guard<std::mutex> l(m_read_mutex);
+            if (piece.ready || piece.copying) {
+                return;
+            }
+            piece.copying = true;
+        }
+        // libtorrent's cache is off in this mode so a verified piece is already in the file. The copy may fault in
+        // pages from the disk, the alert thread mustn't wait on the lock meanwhile.
+        bool copied = m_file->copy(piece.m_buf, piece.m_file_offset, (size_t) piece.m_req.length);
+        std::lock_guard<std::mutex> l(m_read_mutex);
+        piece.copying = false;
+        if (copied) {
+            TRACE(PIECE_COPY, m_span, piece_idx, piece.m_req.length);
+            if (!piece.ready) {
+                piece.ready = true;
+                --m_piece_count;
+            }
+            m_cv.notify_one();
+            return;
+        }
+    }
+    TRACE(PIECE_REQUEST, m_span, piece_idx, 0);
+    m_budget.request(m_handle, piece_idx, m_ti->piece_size(piece_idx));
 }
 
 void ReadTask::try_read_all() {
     for (auto& p : m_pieces) {
-        if (m_handle.have_piece(p.first))
-            m_handle.read_piece(p.first);
+        if (m_handle.have_piece(p.first)) {
+            fetch(p.first, p.second);
+        }
     }
 }
 
@@ -79,33 +117,42 @@ void ReadTask::fail(int piece_idx) {
     if (!piece || piece->ready) {
         return;
     }
+    TRACE(PIECE_FAILED, m_span, piece_idx, 0);
     m_failed = true;
 }
 
+void ReadTask::abort() {
+    std::lock_guard<std::mutex> l(m_read_mutex);
+    m_failed = true;
+    m_cv.notify_one();
+}
+
 void ReadTask::try_read(int piece_idx) {
-    VLOG(3) << "Try read " << piece_idx;
     auto piece = get_piece(piece_idx);
     if (!piece) {
         return;
     }
-    m_handle.read_piece(piece_idx);
-    VLOG(3) << "Sent read request for piece " << piece_idx;
+    if (m_file) { // the reader copies it itself
+        std::lock_guard<std::mutex> l(m_read_mutex);
+        if (!piece->ready) {
+            m_finished.push_back(piece_idx);
+            m_cv.notify_one();
+        }
+        return;
+    }
+    fetch(piece_idx, *piece);
 }
 
 void ReadTask::copy_data(int piece_idx, char *buffer, int size) {
     std::lock_guard<std::mutex> l(m_read_mutex);
-    VLOG(3) << "Want to copy data for idx=" << piece_idx << " size=" << size;
     auto piece = get_piece(piece_idx);
     if (!piece) {
         return;
     }
-    if (!piece->ready) {
-        VLOG(3) << "Data ready, copying idx=" << piece_idx << " offset=" << piece->m_req.start << " size="
-                << piece->m_req.length;
+    if (!piece->ready && !piece->copying) { // otherwise the reader is copying the same data from the mapping
+        TRACE(PIECE_COPY, m_span, piece_idx, piece->m_req.length);
         piece->ready = (memcpy(piece->m_buf, buffer + piece->m_req.start, (size_t) piece->m_req.length)) != NULL;
         --m_piece_count;
-    } else {
-        VLOG(3) << "Data already copied idx=" << piece_idx << " size=" << piece->m_req.length;
     }
     m_cv.notify_one();
 }
@@ -113,7 +160,6 @@ void ReadTask::copy_data(int piece_idx, char *buffer, int size) {
 Piece* ReadTask::get_piece(int piece_idx) {
     auto p = m_pieces.find(piece_idx);
     if (p == m_pieces.end()) {
-        VLOG(3) << "Don't need idx=" << piece_idx;
         return nullptr;
     }
     return &p->second;
@@ -12,32 +12,44 @@
 #include <condition_variable>
 #include <libtorrent/torrent_handle.hpp>
 #include <libtorrent/peer_request.hpp>
+#include "ReadBudget.h"
+#include "MappedFile.h"
 
 struct Piece {
     libtorrent::peer_request m_req;
     char* m_buf;
+    int64_t m_file_offset;
     bool ready = false;
+    bool copying = false; // being copied from the mapping without the lock held
 };
 
 class ReadTask {
 public:
-    ReadTask(const libtorrent::torrent_handle& handle, char *buf, int index, off_t offset,
-            size_t size);
+    ReadTask(const libtorrent::torrent_handle& handle, ReadBudget& budget, MappedFile* file, char *buf, int index,
+            off_t offset, size_t size);
     std::mutex m_read_mutex;
     int read();
     void try_read_all();
     void try_read(int piece_idx);
     void fail(int piece_idx);
+    void abort();
     void copy_data(int piece_idx, char *buffer, int size);
 private:
     const libtorrent::torrent_handle& m_handle;
+    ReadBudget& m_budget;
+    MappedFile* m_file; // verified pieces are copied from here directly if set
+    boost::shared_ptr<const libtorrent::torrent_info> m_ti;
     std::unordered_map<int, Piece> m_pieces;
+    std::vector<int> m_finished; // verified pieces to be copied from m_file on the reader's thread
     int m_piece_count = 0;
     size_t m_effective_size;
     bool m_failed = false;
     std::condition_variable m_cv;
+    uint64_t m_span = 0; // trace span id, only set in tracing builds
+    uint64_t m_started = 0;
 
     void prioritize(int piece_idx, int priority);
+    void fetch(int piece_idx, Piece& piece);
     Piece* get_piece(int piece_idx);
 };
 
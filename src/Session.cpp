@@ -6,33 +6,69 @@
  */
 
 #include "Session.h"
+#include <sstream>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/magnet_uri.hpp>
 #include <libtorrent/torrent_info.hpp>
+#include <libtorrent/bencode.hpp>
+#include <libtorrent/bdecode.hpp>
+#include <libtorrent/error_code.hpp>
 #include <boost/filesystem.hpp>
+#include <fstream>
+#include <condition_variable>
 #include <curl/curl.h>
 #include "easylogging++.h"
+#include "Trace.h"
 #define STRINGIFY(s) #s
 
 #define LOCK_SESSION std::lock_guard<std::recursive_mutex> l(m_mutex)
 
+static const int MAX_SAVED_PEERS = 50;
+static const long FETCH_CONNECT_TIMEOUT = 15; // seconds
+static const long FETCH_TIMEOUT = 60;
+
 Session::Session(btfs_params& params) :
-        m_params(params) {
+        m_params(params), m_budget(params) {
+    m_views.emplace_back();
 }
 
-void Session::stop() {
-    m_stop = true;
-    int flags = 0;
-    {
-        LOCK_SESSION;
-        if (!m_params.keep)
-        flags |= libtorrent::session::delete_files;
-
-        if (m_session) {
-            for (auto& t : m_thmap) {
-                m_session->remove_torrent(t.second->handle(), flags);
-            }
+/*
+ * Runs the tasks on a pool of threads and joins them, tasks not started by the
+ * deadline are skipped. A task that has started is always waited for. Returns
+ * the number of tasks skipped.
+ */
+static size_t run_tasks(std::vector<std::function<void()>> tasks, std::chrono::steady_clock::time_point deadline) {
+    std::mutex mutex;
+    size_t next = 0;
+    size_t done = 0;
+    auto worker = [&] {
+        std::unique_lock<std::mutex> l(mutex);
+        while (next < tasks.size() && std::chrono::steady_clock::now() < deadline) {
+            auto& task = tasks[next++];
+            l.unlock();
+            task();
+            l.lock();
+            ++done;
         }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), tasks.size()); ++i) {
+        pool.emplace_back(worker);
+    }
+    for (auto& t : pool) {
+        t.join();
+    }
+    return tasks.size() - done;
+}
+
+void Session::stop() {
+    if (m_stop.exchange(true)) { // called from btfs_destroy and from the destructor
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    auto deadline = started + std::chrono::seconds(std::max(m_params.shutdown_timeout, 1));
+    if (m_session) {
+        m_session->post_session_stats(); // wakes the alert thread up right away
     }
     try {
         if (m_alert_thread && m_alert_thread->joinable()) { // race condition is possible here, will be caught
@@ -41,13 +77,84 @@ void Session::stop() {
     } catch (const std::exception& e) {
         LOG(WARNING)<< "Couldn't join alert thread: " << e.what();
     }
-    if (!m_params.keep) {
+    if (m_importer) { // copies and hash checks stop at the next chunk or piece, their save paths are cleaned up below
+        m_importer->stop();
+    }
+    VLOG(1) << "Read stats: " << stats();
+    std::unique_ptr<libtorrent::session> session;
+    std::vector<std::function<void()>> saves;
+    std::set<std::string> paths; // with -p all torrents share one directory
+    {
+        LOCK_SESSION;
+        session = std::move(m_session);
+        if (!session) {
+            return;
+        }
+        auto s = session.get();
+        saves.emplace_back([this, s] {
+            save_state(*s);
+        });
         for (auto& t : m_thmap) {
-            namespace fs = boost::filesystem;
-            fs::path save_path(t.first.status().save_path);
-            fs::remove_all(save_path);
+            auto handle = t.first;
+            saves.emplace_back([this, handle] {
+                save_peers(handle);
+            });
+        }
+        if (!m_params.keep) {
+            // one call for all torrents instead of a status() round trip per torrent
+            std::vector<libtorrent::torrent_status> statuses;
+            session->get_torrent_status(&statuses, [](const libtorrent::torrent_status&) {
+                return true;
+            }, libtorrent::torrent_handle::query_save_path);
+            for (auto& st : statuses) {
+                paths.insert(st.save_path);
+            }
+            paths.insert(m_removed_paths.begin(), m_removed_paths.end());
+        }
+    }
+    // state is only an optimization for the next start, it gets half of the time at most
+    if (auto skipped = run_tasks(std::move(saves), started + (deadline - started) / 2)) {
+        LOG(WARNING)<< "Saving state took too long, " << skipped << " torrents not saved";
+    }
+    // destroying the proxy joins libtorrent's threads after the stop announces to trackers, the files can only be
+    // deleted after that. The thread owns everything it uses and is left behind if it's not done by the deadline.
+    struct Done {
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_done = false;
+    };
+    auto done = std::make_shared<Done>();
+    auto proxy = std::make_unique<libtorrent::session_proxy>(session->abort());
+    session.reset();
+    std::thread([proxy = std::move(proxy), paths = std::move(paths), deadline, done]() mutable {
+        proxy.reset();
+        std::vector<std::function<void()>> cleanups;
+        for (auto& p : paths) {
+            cleanups.emplace_back([&p] {
+                boost::system::error_code ec;
+                boost::filesystem::remove_all(p, ec);
+            });
         }
+        run_tasks(std::move(cleanups), deadline);
+        std::lock_guard<std::mutex> l(done->m_mutex);
+        done->m_done = true;
+        done->m_cv.notify_all();
+    }).detach();
+    std::unique_lock<std::mutex> l(done->m_mutex);
+    if (!done->m_cv.wait_until(l, deadline, [&done] {
+        return done->m_done;
+    })) {
+        LOG(WARNING)<< "Shutdown timeout, the session or its files may not be cleaned up";
+        m_abandoned = true;
+        return;
     }
+    VLOG(1) << "Session stopped in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()
+            << " ms";
+}
+
+bool Session::abandoned() {
+    return m_abandoned;
 }
 
 void Session::init() {
@@ -86,14 +193,49 @@ void Session::init() {
     pack.set_int(pack.download_rate_limit, m_params.max_download_rate * 1024);
     pack.set_int(pack.upload_rate_limit, m_params.max_upload_rate * 1024);
     pack.set_int(pack.alert_mask, alerts);
+    // a dropped read_piece_alert delays its readers until ReadBudget times the request out
+    pack.set_int(pack.alert_queue_size, 50000);
+    if (m_params.mmap) {
+        // blocks go to the files (and the page cache) right away, a verified piece can be read from there
+        pack.set_int(pack.cache_size, 0);
+        pack.set_bool(pack.use_read_cache, false);
+    }
 
+    m_upload_limit = m_params.max_upload_rate;
+    if (m_params.import_path) {
+        m_importer = std::make_unique<Importer>(m_params.import_path);
+    }
     m_session = std::make_unique<libtorrent::session>(pack, flags);
+    m_state_dir = populate_state();
+    load_state();
     m_alert_thread = std::make_unique<std::thread>(&Session::alert_queue_loop, this);
 }
 
 void Session::alert_queue_loop() {
     VLOG(1) << "Alert thread started";
+    auto last_tick = std::chrono::steady_clock::now();
     while (!m_stop) {
+#ifdef BTFS_TRACE
+        if (Trace::dump_requested()) {
+            if (Trace::dump("btfsng.trace")) {
+                LOG(INFO)<< "Trace dumped to btfsng.trace";
+            } else {
+                LOG(WARNING)<< "Failed to dump trace to btfsng.trace";
+            }
+        }
+#endif
+        // also lets torrents go back to full speed once their readers are gone
+        schedule();
+
+        // once a second: lost piece reads and web seeds
+        if (std::chrono::steady_clock::now() - last_tick >= std::chrono::seconds(1)) {
+            last_tick = std::chrono::steady_clock::now();
+            m_budget.expire();
+            for (auto& t : get_torrents()) {
+                t->update_web_seeds();
+            }
+        }
+
         if (!m_session->wait_for_alert(libtorrent::seconds(1)))
             continue;
 
@@ -110,47 +252,385 @@ void Session::alert_queue_loop() {
     }
 }
 
-Torrent& Session::add_torrent(const std::string& metadata) {
+static libtorrent::sha1_hash params_hash(const libtorrent::add_torrent_params& params) {
+    return params.ti ? params.ti->info_hash() : params.info_hash;
+}
+
+bool Session::add_ref(const libtorrent::add_torrent_params& params, View* view) {
+    auto& views = m_refs[params_hash(params)];
+    bool added = views.empty();
+    ++views[view];
+    if (added) {
+        return true;
+    }
+    VLOG(1) << "Torrent " << params_hash(params) << " is already added, sharing it";
+    if (!m_params.files_path) { // populate_target() made a directory just for this torrent
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(params.save_path, ec);
+    }
+    return false;
+}
+
+bool Session::importing(const libtorrent::add_torrent_params& params) {
+    // magnet links have no file list yet, their data is only imported when given as a .torrent
+    return m_importer && params.ti && !m_params.browse_only;
+}
+
+void Session::finish_import(libtorrent::add_torrent_params& params) {
     LOCK_SESSION;
+    if (!m_session) {
+        return;
+    }
+    if (m_stop || !m_refs.count(params_hash(params))) { // stopping or removed while being imported
+        VLOG(1) << "Dropping imported torrent " << params_hash(params);
+        if (!m_params.files_path) {
+            m_removed_paths.insert(params.save_path);
+        }
+        return;
+    }
+    m_session->async_add_torrent(params);
+}
+
+void Session::drop_ref(const libtorrent::sha1_hash& hash, View* view) {
+    auto ref = m_refs.find(hash);
+    if (ref == m_refs.end()) {
+        return;
+    }
+    if (--ref->second[view] <= 0) {
+        ref->second.erase(view);
+    }
+    if (ref->second.empty()) {
+        m_refs.erase(ref);
+    }
+}
+
+std::string Session::add_torrent(const std::string& metadata, View* view) {
     VLOG(1) << "Adding torrent from " << metadata;
-    auto handle = m_session->add_torrent(create_torrent_params(metadata));
-    auto res = m_thmap.emplace(handle, std::make_unique<Torrent>(m_params, handle));
-    return *res.first->second;
+    auto params = create_torrent_params(metadata);
+    LOCK_SESSION;
+    if (!view) {
+        view = &m_views.front();
+    }
+    std::ostringstream hash;
+    hash << params_hash(params);
+    libtorrent::torrent_handle handle;
+    if (add_ref(params, view)) {
+        if (importing(params)) { // added with the resume data when the import is done, its alert publishes it
+            m_importer->import(params, [this](libtorrent::add_torrent_params& imported) {
+                finish_import(imported);
+            });
+            return hash.str();
+        }
+        try {
+            handle = m_session->add_torrent(params);
+        } catch (const std::exception& e) {
+            drop_ref(params_hash(params), view);
+            throw;
+        }
+    } else {
+        handle = m_session->find_torrent(params_hash(params));
+    }
+    if (!handle.is_valid()) {
+        // async_add_torrent() of the watcher hasn't completed yet, its alert publishes the torrent in this view too
+        VLOG(1) << "Torrent " << hash.str() << " is still being added";
+        return hash.str();
+    }
+    auto res = m_thmap.emplace(handle, nullptr);
+    if (res.second) { // not known yet if it's still being added asynchronously
+        res.first->second = create_torrent(handle);
+        if (handle.status().has_metadata) {
+            setup_torrent(res.first->second);
+        }
+    } else if (res.first->second && handle.status().has_metadata) { // shared with another mount
+        view->add(res.first->second);
+    }
+    return hash.str();
+}
+
+void Session::setup_torrent(const std::shared_ptr<Torrent>& t) {
+    t->setup();
+    auto ref = m_refs.find(t->handle().info_hash());
+    if (ref == m_refs.end()) {
+        return;
+    }
+    for (auto& v : ref->second) {
+        v.first->add(t);
+    }
+}
+
+View& Session::view() {
+    return m_views.front();
+}
+
+View& Session::add_view() {
+    LOCK_SESSION;
+    m_views.emplace_back();
+    return m_views.back();
+}
+
+void Session::remove_view(View* view) {
+    LOCK_SESSION;
+    if (!m_session) {
+        return;
+    }
+    std::vector<std::string> hashes;
+    for (auto& r : m_refs) {
+        auto v = r.second.find(view);
+        if (v != r.second.end()) {
+            v->second = 1; // all of its adds go with the mount
+            std::ostringstream hash;
+            hash << r.first;
+            hashes.push_back(hash.str());
+        }
+    }
+    for (auto& hash : hashes) {
+        remove_torrent(hash, view);
+    }
+}
+
+std::shared_ptr<Torrent> Session::create_torrent(libtorrent::torrent_handle& handle) {
+    auto t = std::make_shared<Torrent>(m_params, handle, m_budget);
+    t->set_activity_handler([this] {
+        schedule();
+    });
+    t->set_access_log_dir(m_state_dir + "/access");
+    restore_peers(handle);
+    return t;
+}
+
+std::vector<std::string> Session::add_torrents(const std::vector<std::string>& metadatas) {
+    std::vector<std::string> result;
+    std::vector<libtorrent::add_torrent_params> params;
+    // parse everything before taking the lock, fetching and reading metadata may take a while
+    for (auto& metadata : metadatas) {
+        try {
+            params.emplace_back(create_torrent_params(metadata));
+            std::ostringstream hash;
+            hash << (params.back().ti ? params.back().ti->info_hash() : params.back().info_hash);
+            result.push_back(hash.str());
+        } catch (const std::exception& e) {
+            LOG(WARNING)<< "Failed to add torrent from " << metadata << ": " << e.what();
+            result.emplace_back();
+        }
+    }
+    LOCK_SESSION;
+    for (auto& p : params) {
+        if (!add_ref(p, &m_views.front())) {
+            continue;
+        }
+        if (importing(p)) {
+            m_importer->import(p, [this](libtorrent::add_torrent_params& imported) {
+                finish_import(imported);
+            });
+        } else {
+            m_session->async_add_torrent(p);
+        }
+    }
+    return result;
+}
+
+static bool parse_hash(const std::string& info_hash, libtorrent::sha1_hash& hash) {
+    std::istringstream in(info_hash);
+    return info_hash.size() == libtorrent::sha1_hash::size * 2 && (in >> hash);
 }
 
-std::list<std::shared_ptr<Torrent>> Session::get_torrents_by_path(const char* path) {
+decltype(Session::m_thmap)::iterator Session::find_handle(const std::string& info_hash) {
+    libtorrent::sha1_hash hash;
+    if (!parse_hash(info_hash, hash)) {
+        return m_thmap.end();
+    }
+    return m_thmap.find(m_session->find_torrent(hash));
+}
+
+bool Session::remove_torrent(const std::string& info_hash, View* view) {
+    LOCK_SESSION;
+    if (!view) {
+        view = &m_views.front();
+    }
+    libtorrent::sha1_hash hash;
+    if (!parse_hash(info_hash, hash)) {
+        return false;
+    }
+    auto t = m_thmap.find(m_session->find_torrent(hash));
+    auto ref = m_refs.find(hash);
+    if (t == m_thmap.end() && ref == m_refs.end()) {
+        return false;
+    }
+    if (ref != m_refs.end()) {
+        auto v = ref->second.find(view);
+        if (v == ref->second.end()) { // added to other mounts only
+            return false;
+        }
+        if (--v->second > 0) {
+            VLOG(1) << "Torrent " << info_hash << " is still referenced " << v->second << " times";
+            return true;
+        }
+        ref->second.erase(v);
+        if (t != m_thmap.end()) {
+            view->remove(t->second.get());
+        }
+        if (!ref->second.empty()) {
+            VLOG(1) << "Torrent " << info_hash << " is still mounted elsewhere";
+            return true;
+        }
+        m_refs.erase(ref);
+    }
+    if (t == m_thmap.end()) { // async_add_torrent() is still in flight, handle_add_torrent_alert() drops it
+        VLOG(1) << "Torrent " << info_hash << " will be removed once added";
+        return true;
+    }
+    VLOG(1) << "Removing torrent " << info_hash;
+    for (auto& v : m_views) {
+        v.remove(t->second.get());
+    }
+    m_removed_paths.insert(t->first.status(libtorrent::torrent_handle::query_save_path).save_path);
+    m_session->remove_torrent(t->first, m_params.keep ? 0 : libtorrent::session::delete_files);
+    // readers still holding the torrent get EIO, new lookups won't find it anymore
+    t->second->abort();
+    m_budget.forget(t->first);
+    m_thmap.erase(t);
+    return true;
+}
+
+void Session::remove_torrents(const std::vector<std::string>& info_hashes) {
+    LOCK_SESSION;
+    for (auto& hash : info_hashes) {
+        remove_torrent(hash);
+    }
+}
+
+std::shared_ptr<Torrent> Session::find_torrent(const std::string& info_hash) {
+    LOCK_SESSION;
+    auto t = find_handle(info_hash);
+    return t == m_thmap.end() ? nullptr : t->second;
+}
+
+std::list<std::shared_ptr<Torrent>> Session::get_torrents() {
+    LOCK_SESSION;
     std::list<std::shared_ptr<Torrent>> result;
-    bool all = !strcmp(path, "/");
     for (auto& t : m_thmap) {
-        if (all || t.second->has_path(path)) {
-            result.emplace_back(t.second);
-        }
+        result.emplace_back(t.second);
     }
     return result;
 }
 
-void Session::handle_torrent_added_alert(libtorrent::torrent_added_alert *a, Torrent& t) {
+void Session::set_rate_limits(int download, int upload) {
+    LOCK_SESSION;
+    VLOG(1) << "Setting rate limits to " << download << "/" << upload << " kB/s";
+    m_params.max_download_rate = download;
+    m_params.max_upload_rate = upload;
+    m_upload_limit = upload;
+    libtorrent::settings_pack pack;
+    pack.set_int(pack.download_rate_limit, download * 1024);
+    pack.set_int(pack.upload_rate_limit, upload * 1024);
+    m_session->apply_settings(pack);
+    schedule();
+}
+
+void Session::add_mirror(const std::string& url, const std::string& metadata) {
+    LOCK_SESSION;
+    if (!metadata.empty()) {
+        m_torrent_mirrors.emplace(mirror_key(metadata), url);
+    } else if (!url.empty() && url.back() == '/') {
+        m_mirrors.push_back(url);
+    } else {
+        // the URL of a single file can't be right for every torrent
+        throw std::runtime_error("Mirror " + url + " needs the metadata it belongs to or a trailing /");
+    }
+}
+
+std::string Session::mirror_key(const std::string& metadata) {
+    // local .torrent files match however their path is spelled
+    std::unique_ptr<char> r(realpath(metadata.c_str(), NULL));
+    return r ? r.get() : metadata;
+}
+
+std::string Session::stats() {
+    return m_budget.stats();
+}
+
+void Session::schedule() {
+    LOCK_SESSION;
+    if (!m_params.background_rate || !m_session) {
+        return;
+    }
+    std::vector<std::pair<Torrent*, bool>> states;
+    bool foreground = false, reading = false;
+    for (auto& t : m_thmap) {
+        states.emplace_back(t.second.get(), t.second->is_foreground());
+        foreground |= states.back().second;
+        reading |= t.second->is_reading();
+    }
+    // torrents without readers only get the background rate while any other torrent is being read
+    for (auto& s : states) {
+        s.first->set_background(foreground && !s.second);
+    }
+    // an open file alone (e.g. a paused player) doesn't cut uploads, only reads waiting for data do
+    int upload = m_params.max_upload_rate;
+    if (reading && (!upload || upload > m_params.background_rate)) {
+        upload = m_params.background_rate;
+    }
+    if (upload != m_upload_limit) {
+        VLOG(1) << "Session upload limit set to " << upload << " kB/s";
+        m_upload_limit = upload;
+        libtorrent::settings_pack pack;
+        pack.set_int(pack.upload_rate_limit, upload * 1024);
+        m_session->apply_settings(pack);
+    }
+}
+
+void Session::handle_add_torrent_alert(libtorrent::add_torrent_alert *a) {
+    if (a->error) {
+        LOG(WARNING)<< "Failed to add torrent: " << a->error.message();
+        // a duplicate is only possible if the torrent was removed and added again before its first add completed
+        if (a->error != libtorrent::errors::duplicate_torrent) {
+            m_refs.erase(params_hash(a->params));
+        }
+        return;
+    }
+    if (!m_refs.count(a->handle.info_hash())) { // removed while being added
+        VLOG(1) << "Dropping removed torrent " << a->handle.info_hash();
+        m_removed_paths.insert(a->params.save_path);
+        m_session->remove_torrent(a->handle, m_params.keep ? 0 : libtorrent::session::delete_files);
+        return;
+    }
+    auto res = m_thmap.emplace(a->handle, nullptr);
+    if (!res.second) { // a duplicate add_torrent() got there first
+        return;
+    }
+    res.first->second = create_torrent(a->handle);
+    // torrent_added_alert has been posted before this one and was skipped as the handle wasn't known yet
+    if (a->handle.status().has_metadata) {
+        setup_torrent(res.first->second);
+    }
+}
+
+void Session::handle_torrent_added_alert(libtorrent::torrent_added_alert *a, const std::shared_ptr<Torrent>& t) {
     VLOG(1) << "Torrent '" << a->handle.status().name << "' added";
     if (a->handle.status().has_metadata) {
-        t.setup();
+        setup_torrent(t);
     }
 }
 
-void Session::handle_metadata_received_alert(libtorrent::metadata_received_alert *a, Torrent& t) {
+void Session::handle_metadata_received_alert(libtorrent::metadata_received_alert *a,
+        const std::shared_ptr<Torrent>& t) {
     VLOG(1) << "Metadata for '" << a->handle.status().name << "' received";
-    t.setup();
+    setup_torrent(t);
 }
 
 void Session::handle_read_piece_alert(libtorrent::read_piece_alert *a, Torrent& t) {
-    VLOG(2) << "Piece " << a->piece << " read";
     t.read_piece(*a);
 }
 
 void Session::handle_piece_finished_alert(libtorrent::piece_finished_alert *a, Torrent& t) {
-    VLOG(2) << "Piece " << a->piece_index << " finished downloading";
+    t.invalidate_progress();
     t.try_read_all(a->piece_index);
 }
 void Session::handle_alert(libtorrent::alert *a) {
+    if (a->type() == libtorrent::add_torrent_alert::alert_type) {
+        handle_add_torrent_alert((libtorrent::add_torrent_alert *) a);
+        return;
+    }
     decltype(m_thmap)::iterator t;
     libtorrent::torrent_alert* ta = dynamic_cast<libtorrent::torrent_alert*>(a);
     if (ta) {
@@ -166,10 +646,13 @@ void Session::handle_alert(libtorrent::alert *a) {
         handle_piece_finished_alert((libtorrent::piece_finished_alert *) a, *t->second);
         break;
     case libtorrent::metadata_received_alert::alert_type:
-        handle_metadata_received_alert((libtorrent::metadata_received_alert *) a, *t->second);
+        handle_metadata_received_alert((libtorrent::metadata_received_alert *) a, t->second);
         break;
     case libtorrent::torrent_added_alert::alert_type:
-        handle_torrent_added_alert((libtorrent::torrent_added_alert *) a, *t->second);
+        handle_torrent_added_alert((libtorrent::torrent_added_alert *) a, t->second);
+        break;
+    case libtorrent::torrent_checked_alert::alert_type:
+        t->second->invalidate_progress(); // pieces found on disk don't get piece_finished
         break;
     case libtorrent::dht_bootstrap_alert::alert_type:
         // Force DHT announce because libtorrent won't by itself
@@ -202,6 +685,14 @@ libtorrent::add_torrent_params Session::create_torrent_params(const std::string&
     add_params.flags &= ~libtorrent::add_torrent_params::flag_auto_managed;
     add_params.flags &= ~libtorrent::add_torrent_params::flag_paused;
     add_params.save_path = target;
+    {
+        LOCK_SESSION;
+        add_params.url_seeds = m_mirrors;
+        auto r = m_torrent_mirrors.equal_range(mirror_key(metadata));
+        for (auto it = r.first; it != r.second; ++it) {
+            add_params.url_seeds.push_back(it->second);
+        }
+    }
 
     populate_metadata(metadata, add_params);
     return add_params;
@@ -251,6 +742,100 @@ std::string Session::populate_target() {
     }
 }
 
+std::string Session::populate_state() {
+    std::string dir;
+
+    if (m_params.files_path != NULL) {
+        dir = m_params.files_path + std::string("/state");
+    } else if (getenv("HOME")) {
+        dir = getenv("HOME") + std::string("/.local/share/btfsng/state");
+    } else {
+        dir = "/tmp/btfsng/state";
+    }
+
+    create_directory(dir + "/peers");
+    create_directory(dir + "/access");
+    return expand(dir.c_str());
+}
+
+void Session::save_state(libtorrent::session& session) {
+    libtorrent::entry state;
+    session.save_state(state, libtorrent::session::save_dht_state);
+    std::vector<char> buf;
+    libtorrent::bencode(std::back_inserter(buf), state);
+    std::ofstream out(m_state_dir + "/session.dat", std::ios::binary | std::ios::trunc);
+    out.write(buf.data(), buf.size());
+    if (!out) {
+        LOG(WARNING)<< "Couldn't save session state to " << m_state_dir;
+    }
+}
+
+void Session::load_state() {
+    std::ifstream in(m_state_dir + "/session.dat", std::ios::binary);
+    std::vector<char> buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (buf.empty()) {
+        return;
+    }
+    libtorrent::bdecode_node state;
+    libtorrent::error_code ec;
+    if (libtorrent::bdecode(buf.data(), buf.data() + buf.size(), state, ec)) {
+        LOG(WARNING)<< "Couldn't parse saved session state: " << ec.message();
+        return;
+    }
+    VLOG(1) << "Restoring DHT state from " << m_state_dir;
+    m_session->load_state(state, libtorrent::session::save_dht_state);
+}
+
+std::string Session::peers_file(const libtorrent::torrent_handle& handle) {
+    std::ostringstream path;
+    path << m_state_dir << "/peers/" << handle.info_hash();
+    return path.str();
+}
+
+void Session::save_peers(const libtorrent::torrent_handle& handle) {
+    std::vector<libtorrent::peer_info> peers;
+    try {
+        handle.get_peer_info(peers);
+    } catch (const std::exception& e) {
+        return;
+    }
+    std::ostringstream out;
+    int count = 0;
+    for (auto& p : peers) {
+        // only the peers we've connected to have a port that's worth remembering
+        if (!(p.flags & libtorrent::peer_info::local_connection)
+                || (p.flags & (libtorrent::peer_info::connecting | libtorrent::peer_info::handshake))
+                || p.connection_type != libtorrent::peer_info::standard_bittorrent) {
+            continue;
+        }
+        out << p.ip.address().to_string() << ' ' << p.ip.port() << '\n';
+        if (++count >= MAX_SAVED_PEERS) {
+            break;
+        }
+    }
+    if (count) { // keep the previous list if nobody's connected right now
+        std::ofstream(peers_file(handle), std::ios::trunc) << out.str();
+    }
+}
+
+void Session::restore_peers(const libtorrent::torrent_handle& handle) {
+    std::ifstream in(peers_file(handle));
+    std::string ip;
+    unsigned short port;
+    int count = 0;
+    while (in >> ip >> port) {
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::address::from_string(ip, ec);
+        if (!ec) {
+            handle.connect_peer(libtorrent::tcp::endpoint(address, port));
+            ++count;
+        }
+    }
+    if (count) {
+        VLOG(1) << "Connecting to " << count << " known peers of " << handle.info_hash();
+    }
+}
+
 size_t handle_http(void *contents, size_t size, size_t nmemb, void *userp) {
     std::vector<char>& http_response = *(std::vector<char>*) userp;
     // Offset into buffer to write to
@@ -264,6 +849,15 @@ size_t handle_http(void *contents, size_t size, size_t nmemb, void *userp) {
     return nmemb * size;
 }
 
+static int fetch_progress(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    // non-zero aborts the transfer
+    return static_cast<std::atomic<bool>*>(clientp)->load() ? 1 : 0;
+}
+
+void Session::interrupt_fetches() {
+    m_interrupted = true;
+}
+
 void Session::populate_metadata(const std::string& uri, libtorrent::add_torrent_params& params) {
 
     VLOG(1) << "Trying to populate metadata from " << uri;
@@ -276,15 +870,22 @@ void Session::populate_metadata(const std::string& uri, libtorrent::add_torrent_
         curl_easy_setopt(ch, CURLOPT_WRITEDATA, &http_response);
         curl_easy_setopt(ch, CURLOPT_USERAGENT, "btfsng/0.1");
         curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1);
+        // fetches run on the control and FUSE threads, a dead server mustn't hold them forever
+        curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT, FETCH_CONNECT_TIMEOUT);
+        curl_easy_setopt(ch, CURLOPT_TIMEOUT, FETCH_TIMEOUT);
+        curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(ch, CURLOPT_XFERINFOFUNCTION, &fetch_progress);
+        curl_easy_setopt(ch, CURLOPT_XFERINFODATA, &m_interrupted);
 
         VLOG(1) << "http(s) metadata needed, downloading";
         CURLcode res = curl_easy_perform(ch);
 
+        curl_easy_cleanup(ch);
+
         if (res != CURLE_OK)
             throw std::runtime_error(std::string("Download metadata failed: ") + curl_easy_strerror(res));
 
-        curl_easy_cleanup(ch);
-
         libtorrent::error_code ec;
 
         params.ti = boost::make_shared<libtorrent::torrent_info>((const char *) http_response.data(),
@@ -11,8 +11,14 @@
 #include <fuse.h>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <map>
+#include <set>
 #include <boost/unordered_map.hpp>
 #include "Torrent.h"
+#include "ReadBudget.h"
+#include "View.h"
+#include "Importer.h"
 #include <libtorrent/session.hpp>
 #include <libtorrent/alert_types.hpp>
 #include "main.h"
@@ -22,24 +28,70 @@ public:
     Session(btfs_params& params);
     void init();
     void stop();
-    Torrent& add_torrent(const std::string& metadata);
-    std::list<std::shared_ptr<Torrent>> get_torrents_by_path(const char* path);
+    // stop() hit the deadline and left a thread cleaning up, the process must not run static destructors under it
+    bool abandoned();
+    // view is the mount to publish the torrent in, the main one if null
+    // returns the info-hash
+    std::string add_torrent(const std::string& metadata, View* view = nullptr);
+    std::vector<std::string> add_torrents(const std::vector<std::string>& metadatas);
+    bool remove_torrent(const std::string& info_hash, View* view = nullptr);
+    void remove_torrents(const std::vector<std::string>& info_hashes);
+    std::shared_ptr<Torrent> find_torrent(const std::string& info_hash);
+    std::list<std::shared_ptr<Torrent>> get_torrents();
+    View& view();
+    View& add_view();
+    // removes every torrent the mount was given, unless another mount has it too
+    void remove_view(View* view);
+    void set_rate_limits(int download, int upload);
+    // metadata as it's passed to add_torrent(), all torrents if empty, then the URL has to be a directory
+    void add_mirror(const std::string& url, const std::string& metadata = std::string());
+    void schedule();
+    std::string stats();
+    // makes metadata downloads in progress and later ones fail right away
+    void interrupt_fetches();
     ~Session();
 private:
     std::recursive_mutex m_mutex;
     btfs_params& m_params;
+    ReadBudget m_budget;
     std::unique_ptr<libtorrent::session> m_session;
     std::unique_ptr<std::thread> m_alert_thread;
-    bool m_stop = false;
+    std::atomic<bool> m_stop { false };
+    std::atomic<bool> m_interrupted { false }; // aborts metadata downloads in progress
+    std::atomic<bool> m_abandoned { false };
+    std::string m_state_dir; // DHT state and known peers survive restarts here
     boost::unordered_map<libtorrent::torrent_handle, std::shared_ptr<Torrent>> m_thmap;
+    // mounts the torrent is published in -> how many times it has been added there
+    std::map<libtorrent::sha1_hash, std::map<View*, int>> m_refs;
+    std::list<View> m_views; // the main mount comes first
+    std::unique_ptr<Importer> m_importer;
+    std::vector<std::string> m_mirrors; // directory web seeds added to every torrent
+    std::multimap<std::string, std::string> m_torrent_mirrors; // mirror_key() of the metadata -> web seed
+    int m_upload_limit = 0; // session upload limit currently applied, kB/s
+    std::set<std::string> m_removed_paths; // save paths of torrents removed at runtime, cleaned up on stop
     void alert_queue_loop();
+    std::shared_ptr<Torrent> create_torrent(libtorrent::torrent_handle& handle);
     void handle_alert(libtorrent::alert *a);
-    void handle_torrent_added_alert(libtorrent::torrent_added_alert *a, Torrent& t);
-    void handle_metadata_received_alert(libtorrent::metadata_received_alert *a, Torrent& t);
+    void handle_add_torrent_alert(libtorrent::add_torrent_alert *a);
+    void handle_torrent_added_alert(libtorrent::torrent_added_alert *a, const std::shared_ptr<Torrent>& t);
+    void handle_metadata_received_alert(libtorrent::metadata_received_alert *a, const std::shared_ptr<Torrent>& t);
     void handle_read_piece_alert(libtorrent::read_piece_alert *a, Torrent& t);
     void handle_piece_finished_alert(libtorrent::piece_finished_alert *a, Torrent& t);
+    void setup_torrent(const std::shared_ptr<Torrent>& t);
+    bool add_ref(const libtorrent::add_torrent_params& params, View* view);
+    void drop_ref(const libtorrent::sha1_hash& hash, View* view);
+    bool importing(const libtorrent::add_torrent_params& params);
+    void finish_import(libtorrent::add_torrent_params& params);
+    decltype(m_thmap)::iterator find_handle(const std::string& info_hash);
     libtorrent::add_torrent_params create_torrent_params(const std::string& metadata);
+    std::string mirror_key(const std::string& metadata);
     std::string populate_target();
+    std::string populate_state();
+    void save_state(libtorrent::session& session);
+    void load_state();
+    std::string peers_file(const libtorrent::torrent_handle& handle);
+    void save_peers(const libtorrent::torrent_handle& handle);
+    void restore_peers(const libtorrent::torrent_handle& handle);
     void populate_metadata(const std::string& uri, libtorrent::add_torrent_params& params);
 };
 
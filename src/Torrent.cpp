@@ -6,15 +6,27 @@
  */
 
 #include "Torrent.h"
+#include <sstream>
 #include <curl/curl.h>
 #include <libtorrent/torrent_info.hpp>
 #include <libtorrent/magnet_uri.hpp>
 #include "easylogging++.h"
+#include "Trace.h"
 
 #define LOCK_TORRENT std::lock_guard<std::recursive_mutex> l(m_mutex)
 
-Torrent::Torrent(btfs_params& params, libtorrent::torrent_handle& handle) :
-        m_params(params), m_handle(handle) {
+static const auto FOREGROUND_GRACE = std::chrono::seconds(5); // keep the bandwidth between consecutive reads
+static const int BACKGROUND_CONNECTIONS = 8;
+// web seeds are dropped once the swarm has this many peers and brought back below the half of it
+static const int SWARM_PEERS = 8;
+
+// availability of the file's data for the clients that can work around the missing parts
+static const char XATTR_PIECES[] = "user.btfsng.pieces"; // bitmap of the pieces overlapping the file, MSB first
+static const char XATTR_PROGRESS[] = "user.btfsng.progress"; // "<verified bytes> <file size>"
+static const char XATTR_RANGES[] = "user.btfsng.ranges"; // "<start> <end>" line per verified byte range
+
+Torrent::Torrent(btfs_params& params, libtorrent::torrent_handle& handle, ReadBudget& budget) :
+        m_params(params), m_handle(handle), m_budget(budget) {
     m_time_of_mount = time(NULL);
 }
 
@@ -22,148 +34,306 @@ const libtorrent::torrent_handle& Torrent::handle() {
     return m_handle;
 }
 
-bool Torrent::is_root(const char *path) {
-    return strcmp(path, "/") == 0;
+std::string Torrent::info_hash() {
+    std::ostringstream s;
+    s << m_handle.info_hash();
+    return s.str();
 }
 
-bool Torrent::is_dir(const char *path) {
-    return m_dirs.find(path) != m_dirs.end();
+std::string Torrent::name() {
+    return m_handle.status(libtorrent::torrent_handle::query_name).name;
 }
 
-bool Torrent::has_path(const char* path) {
-    return is_dir(path) || is_file(path);
+void Torrent::set_rate_limits(int download, int upload) {
+    LOCK_TORRENT;
+    m_download_limit = download;
+    m_upload_limit = upload;
+    apply_limits();
 }
 
-bool Torrent::is_file(const char *path) {
-    return m_files.find(path) != m_files.end();
+void Torrent::apply_limits() {
+    int download = m_download_limit;
+    if (m_background && (!download || download > m_params.background_rate)) {
+        download = m_params.background_rate;
+    }
+    m_handle.set_download_limit(download * 1024);
+    m_handle.set_upload_limit(m_upload_limit * 1024);
+    m_handle.set_max_connections(m_background ? BACKGROUND_CONNECTIONS : -1);
 }
 
-int Torrent::getattr(const char *path, struct stat *stbuf) {
-    if (!is_dir(path) && !is_file(path) && !is_root(path))
-        return -ENOENT;
+bool Torrent::is_foreground() {
+    LOCK_TORRENT;
+    return m_open_files > 0 || !m_reads.empty()
+            || std::chrono::steady_clock::now() - m_last_read < FOREGROUND_GRACE;
+}
 
-    memset(stbuf, 0, sizeof(*stbuf));
+bool Torrent::is_reading() {
+    LOCK_TORRENT;
+    return !m_reads.empty() || std::chrono::steady_clock::now() - m_last_read < FOREGROUND_GRACE;
+}
 
-    stbuf->st_uid = getuid();
-    stbuf->st_gid = getgid();
-    stbuf->st_mtime = m_time_of_mount;
+void Torrent::set_background(bool background) {
+    LOCK_TORRENT;
+    if (m_background == background || m_aborted) {
+        return;
+    }
+    VLOG(1) << "Torrent " << info_hash() << (background ? " throttled" : " unthrottled");
+    m_background = background;
+    apply_limits();
+}
 
-    if (is_root(path) || is_dir(path)) {
-        stbuf->st_mode = S_IFDIR | 0555;
-    } else {
-        auto ti = m_handle.torrent_file();
+void Torrent::set_activity_handler(std::function<void()> handler) {
+    LOCK_TORRENT;
+    m_activity_handler = handler;
+}
+
+void Torrent::set_access_log_dir(const std::string& dir) {
+    LOCK_TORRENT;
+    m_access_log_dir = dir;
+}
 
-        int64_t file_size = ti->files().file_size(m_files[path]);
+void Torrent::update_web_seeds() {
+    LOCK_TORRENT;
+    if (m_web_seeds.empty() || m_aborted) {
+        return;
+    }
+    int peers = m_handle.status(0).num_peers;
+    if (m_web_seeds_active) {
+        peers -= (int) m_web_seeds.size(); // web seeds are counted as peers too
+    }
+    bool active = m_web_seeds_active ? peers < SWARM_PEERS : peers < SWARM_PEERS / 2;
+    if (active == m_web_seeds_active) {
+        return;
+    }
+    VLOG(1) << "Torrent " << info_hash() << " has " << peers << " peers, web seeds "
+            << (active ? "enabled" : "disabled");
+    for (auto& url : m_web_seeds) {
+        if (active) {
+            m_handle.add_url_seed(url);
+        } else {
+            m_handle.remove_url_seed(url);
+        }
+    }
+    m_web_seeds_active = active;
+}
 
-        std::vector<boost::int64_t> progress;
+void Torrent::add_web_seed(const std::string& url) {
+    LOCK_TORRENT;
+    if (m_aborted || !m_web_seeds.insert(url).second) {
+        return;
+    }
+    if (m_web_seeds_active) {
+        m_handle.add_url_seed(url);
+    }
+}
 
-        // Get number of bytes downloaded of each file
-        m_handle.file_progress(progress, libtorrent::torrent_handle::piece_granularity);
+void Torrent::set_priority(int priority) {
+    auto ti = m_handle.torrent_file();
+    if (!ti) {
+        return;
+    }
+    if (!priority) {
+        LOCK_TORRENT;
+        m_part_file = true;
+    }
+    m_handle.prioritize_files(std::vector<int>(ti->num_files(), priority));
+}
 
-        stbuf->st_blocks = progress[(size_t) m_files[path]] / 512;
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_size = file_size;
+void Torrent::abort() {
+    LOCK_TORRENT;
+    m_aborted = true;
+    for (auto& r : m_reads) {
+        r->abort();
     }
+}
 
-    return 0;
+void Torrent::invalidate_progress() {
+    std::lock_guard<std::mutex> l(m_progress_mutex);
+    m_progress_stale = true;
 }
 
-int Torrent::open(const char* path, struct fuse_file_info* fi) {
-    if (!is_dir(path) && !is_file(path)) {
-        return -ENOENT;
+boost::int64_t Torrent::file_progress(int index) {
+    // listing a directory calls this for every file, ask libtorrent only once per finished piece
+    std::lock_guard<std::mutex> l(m_progress_mutex);
+    if (m_progress_stale) {
+        m_handle.file_progress(m_progress, libtorrent::torrent_handle::piece_granularity);
+        m_progress_stale = false;
     }
+    return (size_t) index < m_progress.size() ? m_progress[(size_t) index] : 0;
+}
 
-    if (is_dir(path)) {
-        return -EISDIR;
+int Torrent::getattr(int index, struct stat *stbuf) {
+    if (m_aborted) {
+        return -ENOENT;
     }
 
+    memset(stbuf, 0, sizeof(*stbuf));
+
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_mtime = m_time_of_mount;
+
+    auto ti = m_handle.torrent_file();
+
+    int64_t file_size = ti->files().file_size(index);
+
+    stbuf->st_blocks = file_progress(index) / 512;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_size = file_size;
+
+    return 0;
+}
+
+int Torrent::open(int index, struct fuse_file_info* fi) {
     if ((fi->flags & 3) != O_RDONLY) {
         return -EACCES;
     }
 
+    std::unique_lock<std::recursive_mutex> l(m_mutex);
+    bool wake = !is_foreground();
+    ++m_open_files;
+    l.unlock();
+    try { // the file is open now, scheduling and prefetch are only hints
+        if (wake && m_activity_handler) {
+            m_activity_handler();
+        }
+        auto log = access_log(index);
+        if (log && !m_params.browse_only) {
+            log->start(m_handle);
+        }
+    } catch (const std::exception& e) {
+        LOG(WARNING)<< "Couldn't prefetch " << info_hash() << ": " << e.what();
+    }
     return 0;
 }
 
-int Torrent::read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    if (!is_dir(path) && !is_file(path)) {
-        return -ENOENT;
+int Torrent::release(int index, struct fuse_file_info *fi) {
+    AccessLog* log = nullptr;
+    {
+        LOCK_TORRENT;
+        if (m_open_files > 0) {
+            --m_open_files;
+        }
+        auto it = m_access_logs.find(index);
+        if (it != m_access_logs.end()) {
+            log = it->second.get();
+        }
     }
-
-    if (is_dir(path)) {
-        return -EISDIR;
+    // logs are never erased and have a lock of their own, reads of the torrent don't wait for the disk
+    if (log) {
+        log->save();
     }
+    return 0;
+}
 
+int Torrent::read(int index, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     if (m_params.browse_only) {
         return -EACCES;
     }
 
-    m_mutex.lock(); // only lock torrent's mutex to add and remove pending reads to avoid races
-    auto& r = *m_reads.emplace(std::make_unique<ReadTask>(m_handle, buf, m_files[path], offset, size)).first;
-    m_mutex.unlock();
+    std::unique_lock<std::recursive_mutex> l(m_mutex); // only lock torrent's mutex to add and remove pending reads to avoid races
+    if (m_aborted) {
+        return -ENOENT;
+    }
+    bool wake = !is_foreground();
+    auto& r = *m_reads.emplace(std::make_unique<ReadTask>(m_handle, m_budget, mapped_file(index), buf, index, offset, size)).first;
+    bool mirrored = !m_web_seeds.empty();
+    l.unlock();
+
+    int s;
+    try {
+        if (wake && m_activity_handler) {
+            m_activity_handler();
+        }
+        auto log = access_log(index);
+        if ((log || mirrored) && size > 0) {
+            auto ti = m_handle.torrent_file();
+            auto& files = ti->files();
+            int64_t piece_length = files.piece_length(), start = files.file_offset(index) + offset;
+            int64_t end = std::min(start + (int64_t) size, files.file_offset(index) + files.file_size(index));
+            for (int64_t p = start / piece_length; p * piece_length < end; ++p) {
+                if (log) {
+                    log->record(m_handle, (int) p);
+                }
+                // time critical pieces are requested from web seeds first, ahead of the bulk download
+                if (mirrored && !m_handle.have_piece((int) p)) {
+                    m_handle.set_piece_deadline((int) p, 0);
+                }
+            }
+        }
 
-    // Wait for read to finish
-    int s = r->read();
+        // Wait for read to finish
+        s = r->read();
+    } catch (const std::exception& e) { // the handle is invalid if the torrent has been removed meanwhile
+        LOG(WARNING)<< "Read from " << info_hash() << " failed: " << e.what();
+        s = -EIO;
+    }
 
-    m_mutex.lock();
+    l.lock();
     m_reads.erase(r);
-    m_mutex.unlock();
+    m_last_read = std::chrono::steady_clock::now();
     return s;
 }
 
-int Torrent::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    if (!is_dir(path) && !is_file(path) && !is_root(path))
-        return -ENOENT;
-
-    if (is_file(path))
-        return -ENOTDIR;
-
-    for (auto& d : m_dirs[path]) {
-        filler(buf, d.c_str(), NULL, 0);
+MappedFile* Torrent::mapped_file(int index) {
+    if (!m_params.mmap || m_part_file) {
+        return nullptr;
+    }
+    auto& f = m_mapped[index];
+    if (!f) {
+        auto save_path = m_handle.status(libtorrent::torrent_handle::query_save_path).save_path;
+        f = std::make_unique<MappedFile>(save_path + "/" + m_handle.torrent_file()->files().file_path(index));
     }
+    return f.get();
+}
 
-    return 0;
+AccessLog* Torrent::access_log(int index) {
+    std::string path;
+    int first_piece, last_piece;
+    {
+        LOCK_TORRENT;
+        if (m_access_log_dir.empty()) {
+            return nullptr;
+        }
+        auto it = m_access_logs.find(index);
+        if (it != m_access_logs.end()) {
+            return it->second.get();
+        }
+        auto ti = m_handle.torrent_file();
+        auto& files = ti->files();
+        int64_t size = std::max<int64_t>(files.file_size(index), 1);
+        path = m_access_log_dir + "/" + info_hash() + "." + std::to_string(index);
+        first_piece = (int) (files.file_offset(index) / files.piece_length());
+        last_piece = (int) ((files.file_offset(index) + size - 1) / files.piece_length());
+    }
+    // loading the learned order reads the disk, reads of the torrent don't wait for it
+    auto log = std::make_unique<AccessLog>(path, first_piece, last_piece);
+    LOCK_TORRENT;
+    auto& published = m_access_logs[index];
+    if (!published) { // another open() or read() of the file may have got there first
+        published = std::move(log);
+    }
+    return published.get();
 }
 
 void Torrent::setup() {
     VLOG(1) << "Got metadata. Now ready to start downloading.";
 
-    auto ti = m_handle.torrent_file();
+    LOCK_TORRENT;
+    if (m_web_seeds_active) { // the url-list has just arrived with the metadata of a magnet link
+        auto seeds = m_handle.url_seeds();
+        m_web_seeds.insert(seeds.begin(), seeds.end());
+    }
 
     if (m_params.browse_only)
         m_handle.pause();
-
-    for (int i = 0; i < ti->num_files(); ++i) {
-        std::string parent("");
-
-        std::unique_ptr<char> p(strdup(ti->files().file_path(i).c_str()));
-
-        if (!p)
-            continue;
-
-        char *ptr;
-        for (char *x = strtok_r(p.get(), "/", &ptr); x; x = strtok_r(NULL, "/", &ptr)) {
-            if (strlen(x) <= 0)
-                continue;
-
-            if (parent.length() <= 0)
-                // Root dir <-> children mapping
-                m_dirs["/"].insert(x);
-            else
-                // Non-root dir <-> children mapping
-                m_dirs[parent].insert(x);
-
-            parent += "/";
-            parent += x;
-        }
-
-        // Path <-> file index mapping
-        m_files["/" + ti->files().file_path(i)] = i;
-    }
 }
 
 void Torrent::read_piece(const libtorrent::read_piece_alert& a) {
     LOCK_TORRENT;
-    VLOG(3) << "Read piece " << a.piece;
+    TRACE(PIECE_READ, 0, a.piece, a.size);
+    // release the budget first: readers added after this point request the piece again
+    m_budget.complete(m_handle, a.piece);
     if (a.ec) {
         LOG(WARNING)<< a.message();
         for (auto& r : m_reads) {
@@ -178,7 +348,76 @@ void Torrent::read_piece(const libtorrent::read_piece_alert& a) {
 
 void Torrent::try_read_all(int piece) {
     LOCK_TORRENT;
+    TRACE(PIECE_FINISHED, 0, piece, 0);
     for (auto& r : m_reads) {
         r->try_read(piece);
     }
 }
+
+static int reply_xattr(const std::string& data, char *value, size_t size) {
+    if (!size) {
+        return (int) data.size();
+    }
+    if (size < data.size()) {
+        return -ERANGE;
+    }
+    memcpy(value, data.data(), data.size());
+    return (int) data.size();
+}
+
+int Torrent::getxattr(int index, const char *name, char *value, size_t size) {
+    if (m_aborted) {
+        return -ENOENT;
+    }
+    auto ti = m_handle.torrent_file();
+    bool pieces = !strcmp(name, XATTR_PIECES), ranges = !strcmp(name, XATTR_RANGES);
+    if (!ti || (!pieces && !ranges && strcmp(name, XATTR_PROGRESS))) {
+        return -ENOATTR;
+    }
+    int64_t file_size = ti->files().file_size(index);
+    if (!pieces && !ranges) {
+        return reply_xattr(std::to_string(file_progress(index)) + " " + std::to_string(file_size), value, size);
+    }
+    std::string data;
+    if (file_size > 0) {
+        int64_t file_offset = ti->files().file_offset(index);
+        int64_t piece_length = ti->piece_length();
+        int first = (int) (file_offset / piece_length);
+        int last = (int) ((file_offset + file_size - 1) / piece_length);
+        auto have = m_handle.status(libtorrent::torrent_handle::query_pieces).pieces;
+        auto has = [&](int p) {
+            return p < have.size() && have.get_bit(p);
+        };
+        if (pieces) {
+            data.assign((size_t) (last - first) / 8 + 1, 0);
+            for (int p = first; p <= last; ++p) {
+                if (has(p)) {
+                    data[(size_t) (p - first) / 8] |= (char) (0x80 >> ((p - first) % 8));
+                }
+            }
+        } else {
+            std::ostringstream out;
+            for (int p = first; p <= last; ++p) {
+                if (!has(p)) {
+                    continue;
+                }
+                int start = p;
+                while (p < last && has(p + 1)) {
+                    ++p;
+                }
+                out << std::max<int64_t>(start * piece_length - file_offset, 0) << ' '
+                        << std::min<int64_t>((p + 1) * piece_length - file_offset, file_size) << '\n';
+            }
+            data = out.str();
+        }
+    }
+    return reply_xattr(data, value, size);
+}
+
+int Torrent::listxattr(char *list, size_t size) {
+    std::string names;
+    for (auto name : { XATTR_PIECES, XATTR_PROGRESS, XATTR_RANGES }) {
+        names.append(name, strlen(name) + 1);
+    }
+    return reply_xattr(names, list, size);
+}
@@ -8,7 +8,10 @@
 #ifndef TORRENT_H_
 #define TORRENT_H_
 
+#include <set>
 #include <mutex>
+#include <chrono>
+#include <functional>
 #include <unordered_map>
 #include <unordered_set>
 #include <fuse.h>
@@ -17,31 +20,69 @@
 #include <libtorrent/alert_types.hpp>
 #include "main.h"
 #include "ReadTask.h"
+#include "MappedFile.h"
+#include "AccessLog.h"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
 
 class Torrent {
 public:
-    Torrent(btfs_params& params, libtorrent::torrent_handle& handle);
+    Torrent(btfs_params& params, libtorrent::torrent_handle& handle, ReadBudget& budget);
     Torrent(const Torrent& o) = delete; // not copyable anyway due to mutex usage but it's better to state that explicitly
     const libtorrent::torrent_handle& handle();
     void setup();
-    int getattr(const char *path, struct stat *stbuf);
-    int open(const char *path, struct fuse_file_info *fi);
-    int read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-    int readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+    int getattr(int index, struct stat *stbuf);
+    int open(int index, struct fuse_file_info *fi);
+    int release(int index, struct fuse_file_info *fi);
+    int read(int index, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+    int getxattr(int index, const char *name, char *value, size_t size);
+    static int listxattr(char *list, size_t size);
     void read_piece(const libtorrent::read_piece_alert& a);
     void try_read_all(int piece);
-    bool has_path(const char *path);
+    void invalidate_progress();
+    std::string info_hash();
+    std::string name();
+    void set_rate_limits(int download, int upload);
+    void set_priority(int priority);
+    void abort();
+    bool is_foreground();
+    bool is_reading();
+    void set_background(bool background);
+    void set_activity_handler(std::function<void()> handler);
+    void set_access_log_dir(const std::string& dir);
+    void update_web_seeds();
+    void add_web_seed(const std::string& url);
 private:
     time_t m_time_of_mount;
     std::recursive_mutex m_mutex;
     btfs_params& m_params;
     libtorrent::torrent_handle m_handle;
-    std::unordered_map<std::string, int> m_files;
-    std::unordered_map<std::string, std::unordered_set<std::string> > m_dirs;
+    ReadBudget& m_budget;
     std::unordered_set<std::unique_ptr<ReadTask>> m_reads;
-    bool is_root(const char *path);
-    bool is_dir(const char *path);
-    bool is_file(const char *path);
+    std::unordered_map<int, std::unique_ptr<MappedFile>> m_mapped; // file index -> mapping, only with --mmap
+    // files with priority 0 keep their pieces in libtorrent's .parts file, a mapping of the file would read holes
+    // as zeros. Stays set as moving the data back into the file when the priority is raised isn't synchronous.
+    bool m_part_file = false;
+    std::string m_access_log_dir; // piece access order is learned only if set
+    std::unordered_map<int, std::unique_ptr<AccessLog>> m_access_logs; // file index -> log
+    bool m_aborted = false;
+    int m_open_files = 0;
+    std::chrono::steady_clock::time_point m_last_read;
+    bool m_background = false;
+    int m_download_limit = 0; // kB/s as set by the user, 0 is unlimited
+    int m_upload_limit = 0;
+    std::function<void()> m_activity_handler; // called when the torrent gets its first reader
+    std::set<std::string> m_web_seeds; // url-list of the torrent and --mirror URLs
+    bool m_web_seeds_active = true; // they're dropped while the swarm alone is fast enough
+    std::mutex m_progress_mutex;
+    std::vector<boost::int64_t> m_progress; // bytes of verified pieces per file, refreshed after piece_finished
+    bool m_progress_stale = true;
+    void apply_limits();
+    boost::int64_t file_progress(int index);
+    MappedFile* mapped_file(int index);
+    AccessLog* access_log(int index);
 };
 
 #endif /* TORRENT_H_ */
@@ -0,0 +1,97 @@
+/*
+ * Trace.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "Trace.h"
+#include <chrono>
+#include <fstream>
+
+static const size_t TRACE_SIZE = 1 << 16; // must be a power of two
+
+static TraceRecord s_records[TRACE_SIZE];
+static std::atomic<uint64_t> s_head(0);
+static std::atomic<uint64_t> s_span(0);
+static std::atomic<bool> s_dump_requested(false);
+
+static const char* event_name(uint8_t event) {
+    switch ((TraceEvent) event) {
+    case TraceEvent::READ_BEGIN:
+        return "read_begin";
+    case TraceEvent::READ_END:
+        return "read_end";
+    case TraceEvent::PIECE_WANTED:
+        return "piece_wanted";
+    case TraceEvent::PIECE_REQUEST:
+        return "piece_request";
+    case TraceEvent::PIECE_READ:
+        return "piece_read";
+    case TraceEvent::PIECE_COPY:
+        return "piece_copy";
+    case TraceEvent::PIECE_FAILED:
+        return "piece_failed";
+    case TraceEvent::PIECE_FINISHED:
+        return "piece_finished";
+    }
+    return "unknown";
+}
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t Trace::new_span() {
+    return s_span.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void Trace::record(TraceEvent event, uint64_t span, int piece, int64_t value) {
+    uint64_t idx = s_head.fetch_add(1, std::memory_order_relaxed);
+    auto& r = s_records[idx & (TRACE_SIZE - 1)];
+    r.m_seq.store(idx * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    r.m_time.store(now(), std::memory_order_relaxed);
+    r.m_span.store(span, std::memory_order_relaxed);
+    r.m_value.store(value, std::memory_order_relaxed);
+    r.m_piece.store(piece, std::memory_order_relaxed);
+    r.m_event.store((uint8_t) event, std::memory_order_relaxed);
+    r.m_seq.store(idx * 2 + 2, std::memory_order_release);
+}
+
+bool Trace::dump(const std::string& filename) {
+    std::ofstream out(filename, std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    uint64_t head = s_head.load(std::memory_order_acquire);
+    uint64_t first = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+    out << "# time_us span event piece value\n";
+    for (uint64_t idx = first; idx < head; ++idx) {
+        auto& r = s_records[idx & (TRACE_SIZE - 1)];
+        uint64_t seq = r.m_seq.load(std::memory_order_acquire);
+        if (seq != idx * 2 + 2) { // being written or already overwritten
+            continue;
+        }
+        uint64_t time = r.m_time.load(std::memory_order_relaxed);
+        uint64_t span = r.m_span.load(std::memory_order_relaxed);
+        int64_t value = r.m_value.load(std::memory_order_relaxed);
+        int32_t piece = r.m_piece.load(std::memory_order_relaxed);
+        uint8_t event = r.m_event.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (r.m_seq.load(std::memory_order_relaxed) != seq) {
+            continue;
+        }
+        out << time << ' ' << span << ' ' << event_name(event) << ' ' << piece << ' ' << value << '\n';
+    }
+    return (bool) out;
+}
+
+void Trace::request_dump() {
+    s_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+bool Trace::dump_requested() {
+    return s_dump_requested.exchange(false, std::memory_order_relaxed);
+}
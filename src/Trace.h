@@ -0,0 +1,58 @@
+/*
+ * Trace.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum class TraceEvent : uint8_t {
+    READ_BEGIN, // value = requested size
+    READ_END, // value = wait time in microseconds, piece = effective size or -errno
+    PIECE_WANTED, // value = length of the slice this read needs
+    PIECE_REQUEST, // read_piece() sent to libtorrent
+    PIECE_READ, // read_piece_alert received, value = piece size
+    PIECE_COPY, // value = bytes copied into the FUSE buffer
+    PIECE_FAILED,
+    PIECE_FINISHED
+};
+
+struct TraceRecord {
+    std::atomic<uint64_t> m_seq; // odd while the slot is being written
+    std::atomic<uint64_t> m_time;
+    std::atomic<uint64_t> m_span;
+    std::atomic<int64_t> m_value;
+    std::atomic<int32_t> m_piece;
+    std::atomic<uint8_t> m_event;
+};
+
+/*
+ * Lock-free ring buffer of read path events. Writers never block, old records are
+ * overwritten. The buffer can be dumped at any time, records that are being
+ * overwritten during the dump are skipped.
+ */
+class Trace {
+public:
+    static void record(TraceEvent event, uint64_t span, int piece, int64_t value);
+    static uint64_t new_span();
+    static uint64_t now(); // microseconds, monotonic
+    static bool dump(const std::string& filename);
+    static void request_dump(); // async-signal-safe
+    static bool dump_requested();
+};
+
+#ifdef BTFS_TRACE
+#define TRACE(event, span, piece, value) Trace::record(TraceEvent::event, (span), (piece), (value))
+#define TRACE_SPAN(span, started) do { (span) = Trace::new_span(); (started) = Trace::now(); } while (0)
+#else
+#define TRACE(event, span, piece, value) do {} while (0)
+#define TRACE_SPAN(span, started) do {} while (0)
+#endif
+
+#endif /* TRACE_H_ */
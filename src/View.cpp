@@ -0,0 +1,247 @@
+/*
+ * View.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "View.h"
+#include <algorithm>
+#include <unordered_set>
+#include <boost/algorithm/string.hpp>
+#include <libtorrent/torrent_info.hpp>
+#include "Torrent.h"
+#include "easylogging++.h"
+
+#define LOCK_VIEW std::lock_guard<std::mutex> l(m_mutex)
+
+static std::string join(const std::string& parent, const std::string& child) {
+    return parent == "/" ? "/" + child : parent + "/" + child;
+}
+
+View::View() {
+    m_time_of_mount = time(NULL);
+    m_dirs["/"];
+}
+
+static std::pair<std::string, std::string> split(const std::string& path) {
+    auto slash = path.rfind('/');
+    return std::make_pair(slash ? path.substr(0, slash) : "/", path.substr(slash + 1));
+}
+
+void View::link(const std::string& path) {
+    auto p = split(path);
+    ++m_dirs[p.first][p.second];
+}
+
+bool View::unlink(const std::string& path) {
+    auto p = split(path);
+    auto d = m_dirs.find(p.first);
+    if (d == m_dirs.end()) {
+        return false;
+    }
+    if (--d->second[p.second] > 0) {
+        return false;
+    }
+    d->second.erase(p.second);
+    return true;
+}
+
+void View::place(Published& p, int index, const std::string& path) {
+    auto& e = p.m_files[index];
+    if (!e.m_path.empty()) {
+        m_files.erase(e.m_path);
+        unlink(e.m_path);
+    }
+    e.m_path = path;
+    if (!path.empty()) {
+        m_files.emplace(path, ViewFile { p.m_torrent, index });
+        link(path);
+    }
+}
+
+std::string View::suffixed(const std::string& path, const std::string& hash) {
+    auto p = split(path);
+    std::string stem = p.second, ext;
+    auto dot = stem.rfind('.');
+    if (dot != std::string::npos && dot > 0) {
+        ext = stem.substr(dot);
+        stem = stem.substr(0, dot);
+    }
+    std::string candidate = join(p.first, stem + "~" + hash.substr(0, 8) + ext);
+    for (int n = 2; m_files.count(candidate) || m_dirs.count(candidate) || m_claims.count(candidate); ++n) {
+        candidate = join(p.first, stem + "~" + hash.substr(0, 8) + "-" + std::to_string(n) + ext);
+    }
+    return candidate;
+}
+
+void View::resolve(const std::string& path) {
+    auto c = m_claims.find(path);
+    if (c == m_claims.end()) {
+        return;
+    }
+    // the map is ordered by info-hash, the first claimant owns the path unless it's a directory
+    const Claimant* owner = m_dirs.count(path) ? nullptr : &c->second.begin()->second;
+    for (auto& claim : c->second) {
+        if (&claim.second == owner) {
+            continue;
+        }
+        auto& p = m_published[claim.second.first];
+        auto& e = p.m_files[claim.second.second];
+        if (e.m_path.empty() || e.m_path == path) {
+            auto to = suffixed(path, claim.first);
+            LOG(WARNING)<< "File " << path << " is taken, exposing as " << to;
+            place(p, claim.second.second, to);
+        }
+    }
+    if (!owner) {
+        return;
+    }
+    auto& p = m_published[owner->first];
+    if (p.m_files[owner->second].m_path != path) {
+        place(p, owner->second, m_files.count(path) ? suffixed(path, p.m_hash) : path);
+    }
+}
+
+void View::add(const std::shared_ptr<Torrent>& t) {
+    auto ti = t->handle().torrent_file();
+    if (!ti) {
+        return;
+    }
+    std::string hash = t->info_hash();
+    LOCK_VIEW;
+    auto res = m_published.emplace(t.get(), Published { t, hash });
+    if (!res.second) { // setup() may run more than once
+        return;
+    }
+    auto& p = res.first->second;
+    std::unordered_set<std::string> linked;
+    std::vector<std::string> created, wanted;
+    for (int i = 0; i < ti->num_files(); ++i) {
+        std::vector<std::string> parts;
+        boost::split(parts, ti->files().file_path(i), boost::is_any_of("/"));
+        parts.erase(std::remove(parts.begin(), parts.end(), ""), parts.end());
+        if (parts.empty()) {
+            continue;
+        }
+        std::string parent = "/";
+        for (size_t c = 0; c + 1 < parts.size(); ++c) {
+            std::string dir = join(parent, parts[c]);
+            if (linked.insert(dir).second) { // directories are merged with other torrents' directories
+                if (!m_dirs.count(dir)) {
+                    created.push_back(dir);
+                    m_dirs[dir];
+                }
+                link(dir);
+                p.m_dirs.push_back(dir);
+            }
+            parent = dir;
+        }
+        std::string path = join(parent, parts.back());
+        p.m_files[i] = Entry { path, "" };
+        m_claims[path].emplace(hash, Claimant(t.get(), i));
+        wanted.push_back(path);
+    }
+    // a new directory pushes a file with the same name aside
+    for (auto& d : created) {
+        auto f = m_files.find(d);
+        if (f != m_files.end() && !m_claims.count(d)) { // a suffixed name that happens to be the directory's
+            auto& fp = m_published[f->second.m_torrent.get()];
+            int index = f->second.m_index;
+            place(fp, index, suffixed(fp.m_files[index].m_wanted, fp.m_hash));
+        }
+        resolve(d);
+    }
+    for (auto& w : wanted) {
+        resolve(w);
+    }
+}
+
+void View::remove(const Torrent* t) {
+    LOCK_VIEW;
+    auto p = m_published.find(t);
+    if (p == m_published.end()) {
+        return;
+    }
+    std::vector<std::string> freed;
+    for (auto& f : p->second.m_files) {
+        place(p->second, f.first, "");
+        auto c = m_claims.find(f.second.m_wanted);
+        if (c != m_claims.end() && c->second.erase(p->second.m_hash) && c->second.empty()) {
+            m_claims.erase(c);
+        } else {
+            freed.push_back(f.second.m_wanted);
+        }
+    }
+    // children were linked after their parents, unlink them first
+    for (auto d = p->second.m_dirs.rbegin(); d != p->second.m_dirs.rend(); ++d) {
+        if (unlink(*d)) {
+            m_dirs.erase(*d);
+            freed.push_back(*d);
+        }
+    }
+    m_published.erase(p);
+    // the files waiting for these paths get them now
+    for (auto& f : freed) {
+        resolve(f);
+    }
+}
+
+bool View::find_file(const char *path, ViewFile& file) {
+    LOCK_VIEW;
+    auto f = m_files.find(path);
+    if (f == m_files.end()) {
+        return false;
+    }
+    file = f->second;
+    return true;
+}
+
+bool View::is_dir(const char *path) {
+    LOCK_VIEW;
+    return m_dirs.count(path);
+}
+
+void View::dir_stat(struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_mtime = m_time_of_mount;
+    stbuf->st_mode = S_IFDIR | 0555;
+}
+
+int View::getattr(const char *path, struct stat *stbuf) {
+    ViewFile file;
+    if (find_file(path, file)) {
+        return file.m_torrent->getattr(file.m_index, stbuf);
+    }
+    if (!is_dir(path)) {
+        return -ENOENT;
+    }
+    dir_stat(stbuf);
+    return 0;
+}
+
+int View::readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+    LOCK_VIEW;
+    if (m_files.count(path)) {
+        return -ENOTDIR;
+    }
+    auto d = m_dirs.find(path);
+    if (d == m_dirs.end()) {
+        return -ENOENT;
+    }
+    // the high-level API only takes the inode and the type bits from it, getattr() has the rest
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    filler(buf, ".", &st, 0);
+    filler(buf, "..", &st, 0);
+    for (auto& c : d->second) {
+        st.st_mode = m_files.count(join(path, c.first)) ? S_IFREG : S_IFDIR;
+        if (filler(buf, c.first.c_str(), &st, 0)) {
+            break;
+        }
+    }
+    return 0;
+}
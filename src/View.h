@@ -0,0 +1,70 @@
+/*
+ * View.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef VIEW_H_
+#define VIEW_H_
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fuse.h>
+
+class Torrent;
+
+struct ViewFile {
+    std::shared_ptr<Torrent> m_torrent;
+    int m_index;
+};
+
+/*
+ * The directory tree of the mount. Files of all torrents are merged into one
+ * namespace where every file path has exactly one owner. Ownership only depends
+ * on the set of torrents, not on the order their metadata arrives in: directories
+ * win over files, and of the files that want the same path the one of the torrent
+ * with the lowest info-hash gets it. The others are exposed as
+ * "name~<first 8 info-hash digits>.ext" and move to the plain name when it's freed.
+ */
+class View {
+public:
+    View();
+    View(const View& o) = delete;
+    void add(const std::shared_ptr<Torrent>& t);
+    void remove(const Torrent* t);
+    bool find_file(const char *path, ViewFile& file);
+    bool is_dir(const char *path);
+    int getattr(const char *path, struct stat *stbuf);
+    int readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+private:
+    struct Entry {
+        std::string m_wanted; // path the torrent has for the file
+        std::string m_path; // path it's exposed at, empty if none
+    };
+    struct Published {
+        std::shared_ptr<Torrent> m_torrent;
+        std::string m_hash;
+        std::unordered_map<int, Entry> m_files; // file index -> entry
+        std::vector<std::string> m_dirs; // directories linked by the torrent, parents first
+    };
+    typedef std::pair<const Torrent*, int> Claimant; // torrent, file index
+    std::mutex m_mutex;
+    time_t m_time_of_mount;
+    std::unordered_map<std::string, ViewFile> m_files;
+    std::unordered_map<std::string, std::unordered_map<std::string, int>> m_dirs; // dir -> child -> number of links
+    std::unordered_map<const Torrent*, Published> m_published;
+    std::unordered_map<std::string, std::map<std::string, Claimant>> m_claims; // wanted path -> info-hash -> file
+    void dir_stat(struct stat *stbuf);
+    void link(const std::string& path);
+    bool unlink(const std::string& path);
+    void place(Published& p, int index, const std::string& path);
+    std::string suffixed(const std::string& path, const std::string& hash);
+    void resolve(const std::string& path);
+};
+
+#endif /* VIEW_H_ */
@@ -0,0 +1,282 @@
+/*
+ * Watcher.cpp
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#include "Watcher.h"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+#include <boost/filesystem.hpp>
+#include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/torrent_info.hpp>
+#include "Session.h"
+#include "easylogging++.h"
+
+static const int BATCH_DELAY_MS = 250; // flush after the directory is quiet for this long
+static const size_t BATCH_SIZE = 1024; // or when this many changes are pending
+static const int RESCAN_INTERVAL_MS = 1000; // without inotify
+
+Watcher::Watcher(Session& session, const std::string& dir) :
+        m_session(session), m_dir(dir) {
+}
+
+void Watcher::start() {
+    if (pipe(m_wake_pipe)) {
+        throw std::runtime_error(std::string("Failed to create watcher pipe: ") + strerror(errno));
+    }
+#ifdef HAVE_INOTIFY
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0) {
+        throw std::runtime_error(std::string("Failed to initialize inotify: ") + strerror(errno));
+    }
+    if (inotify_add_watch(m_inotify_fd, m_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+            < 0) {
+        throw std::runtime_error("Failed to watch " + m_dir + ": " + strerror(errno));
+    }
+#endif
+    VLOG(1) << "Watching " << m_dir << " for torrents";
+    scan();
+    m_thread = std::make_unique<std::thread>(&Watcher::loop, this);
+}
+
+void Watcher::stop() {
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    if (m_wake_pipe[1] >= 0) {
+        char c = 0;
+        if (write(m_wake_pipe[1], &c, 1) < 0) {
+            LOG(WARNING)<< "Couldn't wake watcher thread: " << strerror(errno);
+        }
+    }
+    if (m_thread && m_thread->joinable()) {
+        m_thread->join();
+    }
+    for (int fd : { m_inotify_fd, m_wake_pipe[0], m_wake_pipe[1] }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool Watcher::is_metadata(const std::string& name) {
+    namespace fs = boost::filesystem;
+    auto ext = fs::path(name).extension();
+    return ext == ".torrent" || ext == ".magnet";
+}
+
+std::string Watcher::read_metadata(const std::string& name) {
+    std::string path = m_dir + "/" + name;
+    if (boost::filesystem::path(name).extension() != ".magnet") {
+        return path;
+    }
+    std::ifstream in(path);
+    std::string uri;
+    in >> uri;
+    return uri;
+}
+
+std::string Watcher::read_hash(const std::string& name) {
+    auto metadata = read_metadata(name);
+    libtorrent::error_code ec;
+    libtorrent::sha1_hash hash;
+    if (metadata.find("magnet:") == 0) {
+        libtorrent::add_torrent_params params;
+        libtorrent::parse_magnet_uri(metadata, params, ec);
+        hash = params.info_hash;
+    } else {
+        libtorrent::torrent_info ti(metadata, boost::ref(ec));
+        if (!ec) {
+            hash = ti.info_hash();
+        }
+    }
+    if (ec) {
+        return "";
+    }
+    std::ostringstream out;
+    out << hash;
+    return out.str();
+}
+
+Watcher::Stamp Watcher::stamp(const std::string& name) {
+    struct stat st;
+    if (stat((m_dir + "/" + name).c_str(), &st)) {
+        return Stamp { 0, 0, 0 };
+    }
+    return Stamp { st.st_mtime, st.st_ino, st.st_size };
+}
+
+void Watcher::scan() {
+    namespace fs = boost::filesystem;
+    std::unordered_set<std::string> present;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        auto name = it->path().filename().string();
+        if (is_metadata(name) && fs::is_regular_file(it->status())) {
+            present.insert(name);
+        }
+    }
+    // the directory is the truth, the events collected so far are replaced
+    m_added.clear();
+    m_removed.clear();
+    for (auto& name : present) {
+        auto s = m_stamps.find(name);
+        if (s == m_stamps.end() || !(s->second == stamp(name))) { // new or written since
+            m_added.insert(name);
+        }
+    }
+    for (auto it = m_stamps.begin(); it != m_stamps.end();) {
+        if (present.count(it->first)) {
+            ++it;
+            continue;
+        }
+        if (m_hashes.count(it->first)) {
+            m_removed.insert(it->first);
+        }
+        it = m_stamps.erase(it);
+    }
+    flush();
+}
+
+void Watcher::loop() {
+#ifndef HAVE_INOTIFY
+    // no change notifications, the directory is compared with what was read from it every now and then
+    while (!m_stop) {
+        pollfd fds[] = { { m_wake_pipe[0], POLLIN, 0 } };
+        int r = poll(fds, 1, RESCAN_INTERVAL_MS);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(WARNING)<< "Watcher poll failed: " << strerror(errno);
+            return;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+        scan();
+    }
+#else
+    while (!m_stop) {
+        pollfd fds[] = { { m_inotify_fd, POLLIN, 0 }, { m_wake_pipe[0], POLLIN, 0 } };
+        bool pending = !m_added.empty() || !m_removed.empty();
+        int r = poll(fds, 2, pending ? BATCH_DELAY_MS : -1);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(WARNING)<< "Watcher poll failed: " << strerror(errno);
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        if (r == 0) {
+            flush();
+            continue;
+        }
+        read_events();
+        if (m_added.size() + m_removed.size() >= BATCH_SIZE) {
+            flush();
+        }
+    }
+#endif
+}
+
+#ifdef HAVE_INOTIFY
+void Watcher::read_events() {
+    alignas(inotify_event) char buf[65536];
+    ssize_t len;
+    bool overflow = false;
+    while ((len = ::read(m_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len;) {
+            auto e = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + e->len;
+            if (e->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            if (!e->len || !is_metadata(e->name)) {
+                continue;
+            }
+            if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                // written again or replaced if it's mounted already, flush() compares the info-hash
+                m_removed.erase(e->name);
+                m_added.insert(e->name);
+            } else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                m_added.erase(e->name);
+                if (m_hashes.count(e->name)) {
+                    m_removed.insert(e->name);
+                }
+            }
+        }
+    }
+    if (overflow) {
+        LOG(WARNING)<< "Too many changes in " << m_dir << ", some events were lost, rescanning";
+        scan();
+    }
+}
+#endif
+
+void Watcher::flush() {
+    // a mounted file that was written again is only remounted if it's another torrent now
+    for (auto it = m_added.begin(); it != m_added.end();) {
+        auto h = m_hashes.find(*it);
+        if (h == m_hashes.end()) {
+            ++it;
+            continue;
+        }
+        m_stamps[*it] = stamp(*it);
+        auto hash = read_hash(*it);
+        if (hash.empty() || hash == h->second) { // unchanged or unreadable, the mounted torrent stays
+            it = m_added.erase(it);
+            continue;
+        }
+        VLOG(1) << "Watched file " << *it << " now has torrent " << hash << " instead of " << h->second;
+        m_removed.insert(*it);
+        ++it;
+    }
+    if (!m_removed.empty()) {
+        std::vector<std::string> hashes;
+        for (auto& name : m_removed) {
+            auto h = m_hashes.find(name);
+            if (h != m_hashes.end()) {
+                hashes.push_back(h->second);
+                m_hashes.erase(h);
+            }
+            if (!m_added.count(name)) { // gone rather than replaced
+                m_stamps.erase(name);
+            }
+        }
+        VLOG(1) << "Removing " << hashes.size() << " watched torrents";
+        m_session.remove_torrents(hashes);
+        m_removed.clear();
+    }
+    if (!m_added.empty()) {
+        std::vector<std::string> names(m_added.begin(), m_added.end());
+        std::vector<std::string> metadatas;
+        for (auto& name : names) {
+            metadatas.push_back(read_metadata(name));
+            m_stamps[name] = stamp(name); // failed ones aren't retried until they change
+        }
+        VLOG(1) << "Adding " << names.size() << " watched torrents";
+        auto hashes = m_session.add_torrents(metadatas);
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (!hashes[i].empty()) {
+                m_hashes[names[i]] = hashes[i];
+            }
+        }
+        m_added.clear();
+    }
+}
+
+Watcher::~Watcher() {
+    stop();
+}
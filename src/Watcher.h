@@ -0,0 +1,66 @@
+/*
+ * Watcher.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: rkfg
+ */
+
+#ifndef WATCHER_H_
+#define WATCHER_H_
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
+
+class Session;
+
+/*
+ * Watches a spool directory for .torrent and .magnet files (the latter contain
+ * a magnet link) and mirrors them in the session. Events are coalesced until
+ * the directory is quiet for a moment or the batch is full, then the whole batch
+ * is added or removed at once. A file that is written again or replaced is read
+ * again and its torrent replaced if the info-hash has changed.
+ */
+class Watcher {
+public:
+    Watcher(Session& session, const std::string& dir);
+    Watcher(const Watcher& o) = delete;
+    void start();
+    void stop();
+    ~Watcher();
+private:
+    Session& m_session;
+    std::string m_dir;
+    int m_inotify_fd = -1; // -1 without inotify, the directory is rescanned then
+    int m_wake_pipe[2] = { -1, -1 };
+    std::atomic<bool> m_stop { false };
+    std::unique_ptr<std::thread> m_thread;
+    struct Stamp {
+        time_t m_mtime;
+        ino_t m_ino;
+        off_t m_size;
+        bool operator==(const Stamp& o) const {
+            return m_mtime == o.m_mtime && m_ino == o.m_ino && m_size == o.m_size;
+        }
+    };
+    std::unordered_map<std::string, std::string> m_hashes; // file name -> info hash
+    std::unordered_map<std::string, Stamp> m_stamps; // file name -> what it looked like when last read
+    std::unordered_set<std::string> m_added;
+    std::unordered_set<std::string> m_removed;
+    void loop();
+    void scan();
+#ifdef HAVE_INOTIFY
+    void read_events();
+#endif
+    void flush();
+    bool is_metadata(const std::string& name);
+    std::string read_metadata(const std::string& name);
+    std::string read_hash(const std::string& name);
+    Stamp stamp(const std::string& name);
+};
+
+#endif /* WATCHER_H_ */
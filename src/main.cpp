@@ -12,10 +12,15 @@
 #include <iostream>
 #include <fstream>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <fuse.h>
 #include <curl/curl.h>
@@ -25,6 +30,9 @@
 #include "main.h"
 #include "Session.h"
 #include "Torrent.h"
+#include "Control.h"
+#include "Watcher.h"
+#include "Trace.h"
 #include "easylogging++.h"
 INITIALIZE_EASYLOGGINGPP
 
@@ -32,12 +40,35 @@ std::list<std::string> metadatas;
 
 static struct btfs_params params;
 static Session sess(params);
+static std::unique_ptr<Control> control;
+static std::unique_ptr<Watcher> watcher;
+static struct fuse_operations btfs_ops;
+
+// additional mountpoints served by the same session, each with its own set of torrents
+struct Mount {
+    std::string m_path;
+    std::list<std::string> m_metadatas;
+    View* m_view = nullptr;
+    struct fuse_chan* m_chan = nullptr;
+    struct fuse* m_fuse = nullptr;
+    std::thread m_thread;
+    std::atomic<bool> m_done { false }; // fuse_loop_mt() has returned
+};
+static std::list<Mount> mounts;
+static std::atomic<bool> unmounting { false };
+
+enum {
+    KEY_MOUNT, KEY_MIRROR
+};
+static std::list<std::pair<std::string, std::string>> mirrors; // metadata, empty for all torrents -> URL
 
 #define BTFS_OPT(t, p, v) { t, offsetof(struct btfs_params, p), v }
 
 static const struct fuse_opt btfs_opts[] = {
 FUSE_OPT_KEY("-v", FUSE_OPT_KEY_DISCARD),
 FUSE_OPT_KEY("--v=", FUSE_OPT_KEY_DISCARD),
+FUSE_OPT_KEY("--mount=", KEY_MOUNT),
+FUSE_OPT_KEY("--mirror=", KEY_MIRROR),
 BTFS_OPT("--version", version, 1),
 BTFS_OPT( "-h", help, 1),
 BTFS_OPT("--help", help, 1),
@@ -46,12 +77,19 @@ BTFS_OPT("-b", browse_only, 1),
 BTFS_OPT("--browse-only", browse_only, 1),
 BTFS_OPT("-k", keep, 1),
 BTFS_OPT("--keep", keep, 1),
-BTFS_OPT( "--min-port=%lu", min_port, 4),
-BTFS_OPT("--max-port=%lu", max_port, 4),
-BTFS_OPT("--max-download-rate=%lu", max_download_rate, 4),
-BTFS_OPT("--max-upload-rate=%lu", max_upload_rate, 4),
+BTFS_OPT( "--min-port=%d", min_port, 4),
+BTFS_OPT("--max-port=%d", max_port, 4),
+BTFS_OPT("--max-download-rate=%d", max_download_rate, 4),
+BTFS_OPT("--max-upload-rate=%d", max_upload_rate, 4),
+BTFS_OPT("--background-rate=%d", background_rate, 4),
+BTFS_OPT("--max-inflight=%d", max_inflight, 4),
+BTFS_OPT("--mmap", mmap, 1),
+BTFS_OPT("--shutdown-timeout=%d", shutdown_timeout, 4),
 BTFS_OPT("-p %s", files_path, 1),
 BTFS_OPT("--path=%s", files_path, 1),
+BTFS_OPT("--control=%s", control_path, 1),
+BTFS_OPT("--watch=%s", watch_path, 1),
+BTFS_OPT("--import=%s", import_path, 1),
 FUSE_OPT_END };
 
 std::unique_ptr<char> cwd(getcwd(NULL, 0));
@@ -61,6 +99,39 @@ static int btfs_process_arg(void *data, const char *arg, int key, struct fuse_ar
         metadatas.push_back(arg);
         return 0;
     }
+    if (key == KEY_MIRROR) {
+        // --mirror=[<metadata>=]<url>, magnet links have '=' in them so the URL's scheme marks the split
+        std::string spec(arg + strlen("--mirror="));
+        auto split = spec.rfind("=http://");
+        auto https = spec.rfind("=https://");
+        if (https != std::string::npos && (split == std::string::npos || https > split)) {
+            split = https;
+        }
+        if (split == std::string::npos) {
+            mirrors.emplace_back(std::string(), spec);
+        } else {
+            mirrors.emplace_back(spec.substr(0, split), spec.substr(split + 1));
+        }
+        return 0;
+    }
+    if (key == KEY_MOUNT) {
+        // --mount=<dir>[:<metadata>], repeated for every torrent of the mount
+        std::string spec(arg + strlen("--mount="));
+        auto colon = spec.find(':');
+        std::string path = spec.substr(0, colon);
+        auto m = std::find_if(mounts.begin(), mounts.end(), [&](const Mount& m) {
+            return m.m_path == path;
+        });
+        if (m == mounts.end()) {
+            mounts.emplace_back();
+            m = std::prev(mounts.end());
+            m->m_path = path;
+        }
+        if (colon != std::string::npos && colon + 1 < spec.size()) {
+            m->m_metadatas.push_back(spec.substr(colon + 1));
+        }
+        return 0;
+    }
 
     return 1;
 }
@@ -78,64 +149,213 @@ static void print_help() {
     printf("    --max-port=N           end of listen port range\n");
     printf("    --max-download-rate=N  max download rate (in kB/s)\n");
     printf("    --max-upload-rate=N    max upload rate (in kB/s)\n");
+    printf("    --background-rate=N    download rate of torrents without readers and upload\n");
+    printf("                           rate while files are being read (in kB/s, e.g. 64,\n");
+    printf("                           default 0 is disabled)\n");
+    printf("    --max-inflight=N       memory for piece reads in flight (in MB, default 64)\n");
+    printf("    --mmap                 serve downloaded pieces straight from the mapped files\n");
+    printf("                           and disable libtorrent's own disk cache\n");
+    printf("    --shutdown-timeout=N   time to save state and remove downloaded files on\n");
+    printf("                           unmount (in seconds, default 10)\n");
     printf("    -p <dir>, --path=<dir> path to store downloaded files\n");
+    printf("    --control=<socket>     listen for commands (add, remove, rate, torrent-rate,\n");
+    printf("                           priority, mirror, list, stats) on this Unix socket\n");
+    printf("    --watch=<dir>          mount .torrent and .magnet files from this directory,\n");
+    printf("                           unmount them when the files are removed\n");
+    printf("    --import=<dir>         reuse files from this directory that match torrent\n");
+    printf("                           files by name and size instead of downloading them\n");
+    printf("    --mount=<dir>:<metadata>\n");
+    printf("                           also mount the torrent at dir using the same session,\n");
+    printf("                           repeat for more torrents and mountpoints\n");
+    printf("    --mirror=[<metadata>=]<url>\n");
+    printf("                           HTTP mirror of the torrent's data (web seed), used while\n");
+    printf("                           the swarm is small, can be repeated. Without metadata\n");
+    printf("                           the URL must be a directory (end with /), it's used for\n");
+    printf("                           all torrents\n");
     printf("    -v, --v=N              verbose logging (1-3)\n");
 }
+static void start_mounts() {
+    for (auto& m : mounts) {
+        m.m_view = &sess.add_view();
+        for (auto& metadata : m.m_metadatas) {
+            sess.add_torrent(metadata, m.m_view);
+        }
+        struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+        fuse_opt_add_arg(&args, "btfsng");
+        m.m_chan = fuse_mount(m.m_path.c_str(), &args);
+        if (m.m_chan) {
+            m.m_fuse = fuse_new(m.m_chan, &args, &btfs_ops, sizeof(btfs_ops), m.m_view);
+            if (!m.m_fuse) {
+                fuse_unmount(m.m_path.c_str(), m.m_chan);
+            }
+        }
+        fuse_opt_free_args(&args);
+        if (!m.m_fuse) {
+            LOG(ERROR)<< "Couldn't mount " << m.m_path;
+            continue;
+        }
+        m.m_thread = std::thread([&m] {
+            fuse_loop_mt(m.m_fuse);
+            m.m_done = true;
+            if (!unmounting) { // fusermount -u from outside, the torrents aren't needed anymore
+                LOG(INFO)<< m.m_path << " was unmounted, removing its torrents";
+                sess.remove_view(m.m_view);
+            }
+        });
+        LOG(INFO)<< "Mounted " << m.m_metadatas.size() << " torrents at " << m.m_path;
+    }
+}
+
+static void stop_mounts() {
+    unmounting = true;
+    for (auto& m : mounts) {
+        if (!m.m_fuse) {
+            continue;
+        }
+        fuse_exit(m.m_fuse);
+        if (!m.m_done) {
+            // the workers only wake up from reading the device once it's unmounted, the channel is left
+            // to fuse_destroy() as they may still use it
+            fuse_unmount(m.m_path.c_str(), nullptr);
+        }
+        m.m_thread.join();
+        fuse_destroy(m.m_fuse);
+        m.m_fuse = nullptr;
+    }
+}
+
 static void* btfs_init(struct fuse_conn_info *conn) {
+    auto view = fuse_get_context()->private_data;
+    if (view) { // one of the --mount mountpoints, the session is already running
+        return view;
+    }
     try {
         chdir(cwd.get());
         sess.init();
         for (auto& metadata : metadatas) {
             sess.add_torrent(metadata);
         }
+        if (params.control_path) {
+            control = std::make_unique<Control>(sess, params.control_path);
+            control->start();
+        }
+        if (params.watch_path) {
+            watcher = std::make_unique<Watcher>(sess, params.watch_path);
+            watcher->start();
+        }
+        start_mounts();
     } catch (const std::exception& e) {
         LOG(FATAL)<< "Error initializing session: " << e.what();
         fuse_exit(fuse_get_context()->fuse);
     }
-    return NULL;
+    return &sess.view();
 }
 
-inline static int do_for_torrents(const char *path, std::function<int(const std::shared_ptr<Torrent>&)> f) {
-    auto ts = sess.get_torrents_by_path(path);
-    int r = 0;
-    for (auto& t : ts) {
-        if ((r = f(t)) < 0) {
-            break;
-        }
+// every mount passes its View as the private data
+inline static View& current_view() {
+    return *static_cast<View*>(fuse_get_context()->private_data);
+}
+
+// synchronous libtorrent calls throw if the torrent is removed while a FUSE call is using it
+inline static int guard(std::function<int()> f) {
+    try {
+        return f();
+    } catch (const std::exception& e) {
+        LOG(WARNING)<< "FUSE call failed: " << e.what();
+        return -EIO;
+    }
+}
+
+inline static int do_for_file(const char *path, std::function<int(const ViewFile&)> f) {
+    ViewFile file;
+    if (!current_view().find_file(path, file)) {
+        return current_view().is_dir(path) ? -EISDIR : -ENOENT;
     }
-    return r;
+    return guard([&] {
+        return f(file);
+    });
 }
 
 static int btfs_getattr(const char *path, struct stat *stbuf) {
-    return do_for_torrents(path, [=](auto& t) {
-        return t->getattr(path, stbuf);
+    return guard([=] {
+        return current_view().getattr(path, stbuf);
     });
 }
 
 static int btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    return do_for_torrents(path, [=](auto& t) {
-        return t->readdir(path, buf, filler, offset, fi);
+    return guard([=] {
+        return current_view().readdir(path, buf, filler);
     });
 }
 
 static int btfs_open(const char *path, struct fuse_file_info *fi) {
-    return do_for_torrents(path, [=](auto& t) {
-        return t->open(path, fi);
+    return do_for_file(path, [=](auto& f) {
+        int r = f.m_torrent->open(f.m_index, fi);
+        if (!r) {
+            // the path may be given to another torrent while the file is open, the open file stays the same
+            fi->fh = (uint64_t) new ViewFile(f);
+        }
+        return r;
+    });
+}
+
+static int btfs_release(const char *path, struct fuse_file_info *fi) {
+    std::unique_ptr<ViewFile> f((ViewFile*) fi->fh);
+    return guard([&] {
+        return f->m_torrent->release(f->m_index, fi);
     });
 }
 
 static int btfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    return do_for_torrents(path, [=](auto& t) {
-       return t->read(path, buf, size, offset, fi);
+    auto f = (ViewFile*) fi->fh;
+    return guard([=] {
+        return f->m_torrent->read(f->m_index, buf, size, offset, fi);
     });
 }
 
+#ifdef __APPLE__
+// macFUSE passes an offset into resource forks, the attributes here don't have any
+static int btfs_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t position) {
+#else
+static int btfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+#endif
+    ViewFile file;
+    if (!current_view().find_file(path, file)) {
+        return current_view().is_dir(path) ? -ENOATTR : -ENOENT;
+    }
+    return guard([&] {
+        return file.m_torrent->getxattr(file.m_index, name, value, size);
+    });
+}
+
+static int btfs_listxattr(const char *path, char *list, size_t size) {
+    ViewFile file;
+    if (!current_view().find_file(path, file)) {
+        return current_view().is_dir(path) ? 0 : -ENOENT;
+    }
+    return Torrent::listxattr(list, size);
+}
+
 static void btfs_destroy(void *user_data) {
+    if (user_data != &sess.view()) { // the session belongs to the main mountpoint
+        return;
+    }
+    stop_mounts();
+    if (watcher) {
+        watcher->stop();
+    }
+    if (control) {
+        control->stop();
+    }
     sess.stop();
 }
 
+#ifdef BTFS_TRACE
+static void handle_dump_signal(int) {
+    Trace::request_dump();
+}
+#endif
+
 void initLog() {
     el::Configurations defaultConf;
     defaultConf.setToDefault();
@@ -152,22 +372,26 @@ void initLog() {
 int main(int argc, char *argv[]) {
     START_EASYLOGGINGPP(argc, argv);
     initLog();
-    struct fuse_operations btfs_ops;
     memset(&btfs_ops, 0, sizeof(btfs_ops));
     btfs_ops.init = btfs_init;
     btfs_ops.getattr = btfs_getattr;
     btfs_ops.readdir = btfs_readdir;
     btfs_ops.open = btfs_open;
     btfs_ops.read = btfs_read;
+    btfs_ops.release = btfs_release;
+    btfs_ops.getxattr = btfs_getxattr;
+    btfs_ops.listxattr = btfs_listxattr;
     btfs_ops.destroy = btfs_destroy;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     params.mountpoint = argv[argc - 1];
+    params.max_inflight = 64;
+    params.shutdown_timeout = 10;
     if (fuse_opt_parse(&args, &params, btfs_opts, btfs_process_arg)) {
         LOG(FATAL)<< "Failed to parse options";
         return 1;
     }
 
-    if (metadatas.empty()) {
+    if (metadatas.empty() && mounts.empty() && !params.control_path && !params.watch_path) {
         params.help = 1;
     }
 
@@ -212,11 +436,29 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+#ifdef BTFS_TRACE
+    // kill -USR1 dumps the read path trace to btfsng.trace in the working directory
+    signal(SIGUSR1, handle_dump_signal);
+#endif
+
+    try {
+        for (auto& mirror : mirrors) {
+            sess.add_mirror(mirror.second, mirror.first);
+        }
+    } catch (const std::exception& e) {
+        LOG(FATAL)<< e.what();
+        return 1;
+    }
+
     curl_global_init(CURL_GLOBAL_ALL);
 
     fuse_main(args.argc, args.argv, &btfs_ops, NULL);
 
     curl_global_cleanup();
 
+    if (sess.abandoned()) { // everything is unmounted, the rest is only cleanup past the shutdown timeout
+        _exit(0);
+    }
+
     return 0;
 }
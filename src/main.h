@@ -19,8 +19,15 @@ struct btfs_params {
     int max_port;
     int max_download_rate;
     int max_upload_rate;
+    int background_rate;
+    int max_inflight;
+    int mmap;
+    int shutdown_timeout;
     char* mountpoint;
     char* files_path;
+    char* control_path;
+    char* watch_path;
+    char* import_path;
 };
 
 #endif /* MAIN_H_ */
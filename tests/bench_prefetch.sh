@@ -0,0 +1,46 @@
+#!/bin/sh
+# Cold-open benchmark of the learned prefetch. A file is read in a fixed random
+# order of pieces from a rate limited seeder twice: with an empty state/access and
+# again after the first run has saved its access order. The downloaded data is
+# deleted in between, so both runs fetch every piece. The wait times come from the
+# read_begin/read_end spans of the trace, btfsng has to be configured with
+# "meson build -Dtrace=true".
+#
+# Usage: tests/bench_prefetch.sh [path to btfsng, build/btfsng by default]
+# SEED_RATE (kB/s, 4096 by default) and THINK_MS (pause between reads, 20 by
+# default) control how much the prefetch can get ahead.
+
+BTFSNG="$(readlink -f "${1:-build/btfsng}")"
+. "$(dirname "$0")/common.sh"
+
+SEED_RATE=${SEED_RATE:-4096}
+THINK_MS=${THINK_MS:-20}
+
+make_torrent 32
+start_seeder "$SEED_RATE"
+cd "$WORK"
+
+# reads 64 KiB from every piece in the same shuffled order every time
+read_pattern() {
+  python3 - "$WORK/mnt/data.bin" "$THINK_MS" <<'EOF'
+import os, random, sys, time
+path, think = sys.argv[1], int(sys.argv[2]) / 1000.0
+pieces = list(range(os.path.getsize(path) // (256 * 1024)))
+random.Random(42).shuffle(pieces)
+with open(path, "rb") as f:
+    for p in pieces:
+        f.seek(p * 256 * 1024)
+        f.read(64 * 1024)
+        time.sleep(think)
+EOF
+}
+
+for run in cold learned; do
+  mount_btfsng "$(seeder_magnet)"
+  read_pattern
+  dump_trace "$WORK/$run.trace"
+  unmount_btfsng
+  [ "$run" = learned ] || [ -f "$WORK/path/state/access/$HASH.0" ] || fail "the access order wasn't saved"
+  printf '%-8s ' "$run:"
+  trace_summary "$WORK/$run.trace"
+done
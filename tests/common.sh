@@ -0,0 +1,148 @@
+# Helpers shared by the scripts in this directory, sourced with BTFSNG set to the
+# binary. Everything lives in a temporary directory that's removed on exit.
+# Needs fuse and the libtorrent python bindings ("python3-libtorrent").
+
+set -e
+
+PORT=${SEED_PORT:-6991}
+TIMEOUT=${TIMEOUT:-60}
+WORK="$(mktemp -d)"
+SEEDER=
+SERVER=
+MOUNTED=
+
+cleanup() {
+  [ -n "$MOUNTED" ] && fusermount -u "$WORK/mnt" 2>/dev/null || true
+  [ -n "$SEEDER" ] && kill "$SEEDER" 2>/dev/null || true
+  [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null || true
+  wait 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# make_torrent <size in MiB>: random $WORK/seed/data.bin, $WORK/data.torrent and its info-hash in HASH
+make_torrent() {
+  mkdir -p "$WORK/seed" "$WORK/mnt" "$WORK/path"
+  head -c "$1"M /dev/urandom > "$WORK/seed/data.bin"
+  python3 - "$WORK" <<'EOF'
+import sys, libtorrent as lt
+work = sys.argv[1]
+fs = lt.file_storage()
+lt.add_files(fs, work + "/seed/data.bin")
+t = lt.create_torrent(fs, 256 * 1024)
+lt.set_piece_hashes(t, work + "/seed")
+with open(work + "/data.torrent", "wb") as f:
+    f.write(lt.bencode(t.generate()))
+with open(work + "/hash", "w") as f:
+    f.write(str(lt.torrent_info(work + "/data.torrent").info_hash()))
+EOF
+  HASH="$(cat "$WORK/hash")"
+}
+
+# start_seeder [upload limit in kB/s]: seeds data.bin on 127.0.0.1:$PORT, no DHT, LSD or trackers
+start_seeder() {
+  python3 - "$WORK" "$PORT" "${1:-0}" <<'EOF' &
+import sys, time, libtorrent as lt
+work, port, rate = sys.argv[1], sys.argv[2], int(sys.argv[3])
+s = lt.session({"listen_interfaces": "127.0.0.1:" + port, "enable_dht": False, "enable_lsd": False,
+                "enable_upnp": False, "enable_natpmp": False, "upload_rate_limit": rate * 1024})
+s.add_torrent({"ti": lt.torrent_info(work + "/data.torrent"), "save_path": work + "/seed",
+               "flags": lt.add_torrent_params_flags_t.flag_seed_mode})
+while True:
+    time.sleep(1)
+EOF
+  SEEDER=$!
+}
+
+# start_mirror: serves $WORK/seed over HTTP on 127.0.0.1:$MIRROR_PORT, with the range
+# requests web seeds need and python's http.server doesn't answer by itself
+MIRROR_PORT=$((PORT + 20))
+start_mirror() {
+  python3 - "$WORK/seed" "$MIRROR_PORT" <<'EOF' &
+import http.server, io, os, re, sys
+os.chdir(sys.argv[1])
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def send_head(self):
+        m = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        path = self.translate_path(self.path)
+        if not m or not os.path.isfile(path):
+            return super().send_head()
+        size = os.path.getsize(path)
+        start, end = int(m.group(1)), min(int(m.group(2) or size - 1), size - 1)
+        with open(path, "rb") as f:
+            f.seek(start)
+            data = f.read(end - start + 1)
+        self.send_response(206)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        return io.BytesIO(data)
+    def log_message(self, *args):
+        pass
+http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[2])), Handler).serve_forever()
+EOF
+  SERVER=$!
+}
+
+mirror_url() {
+  echo "http://127.0.0.1:$MIRROR_PORT/"
+}
+
+# magnet link that makes btfsng connect to the seeder
+seeder_magnet() {
+  echo "magnet:?xt=urn:btih:$HASH&x.pe=127.0.0.1:$PORT"
+}
+
+# mount_btfsng <metadata> [options]: mounts at $WORK/mnt with the files and state under $WORK/path,
+# started from the current directory, and waits for data.bin to show up
+mount_btfsng() {
+  metadata="$1"
+  shift
+  "$BTFSNG" -f -p "$WORK/path" --min-port=$((PORT + 1)) --max-port=$((PORT + 10)) "$@" "$metadata" "$WORK/mnt" &
+  MOUNTED=$!
+  i=0
+  until [ -f "$WORK/mnt/data.bin" ]; do
+    i=$((i + 1))
+    [ $i -le "$TIMEOUT" ] || fail "data.bin didn't show up"
+    sleep 1
+  done
+}
+
+# unmount_btfsng: the downloaded files are deleted, the state is kept
+unmount_btfsng() {
+  fusermount -u "$WORK/mnt"
+  wait "$MOUNTED" || true
+  MOUNTED=
+}
+
+# dump_trace <file>: needs a build configured with -Dtrace=true
+dump_trace() {
+  rm -f btfsng.trace
+  kill -USR1 "$MOUNTED"
+  i=0
+  until [ -s btfsng.trace ]; do
+    i=$((i + 1))
+    [ $i -le "$TIMEOUT" ] || fail "no trace, was btfsng built with -Dtrace=true?"
+    sleep 1
+  done
+  sleep 1
+  mv btfsng.trace "$1"
+}
+
+# trace_summary <file>: how long the FUSE reads in the trace waited for data
+trace_summary() {
+  awk '
+    $1 ~ /^#/ { next }
+    $3 == "read_begin" { if (!first || $1 < first) first = $1; if (!first_span || $2 < first_span) first_span = $2 }
+    $3 == "read_end" { n++; total += $5; if ($5 > max) max = $5; if ($1 > last) last = $1; wait[$2] = $5 }
+    END {
+      printf "%d reads, first %.1f ms, longest %.1f ms, %.1f ms waiting in total, %.1f ms from the first to the last\n",
+        n, wait[first_span] / 1000, max / 1000, total / 1000, (last - first) / 1000
+    }' "$1"
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Checks the warm start: a torrent seeded on 127.0.0.1 is mounted through a magnet
+# link pointing at the seeder, unmounted, then mounted again from the .torrent file
+# alone. The second mount has no tracker, DHT or LSD to find the seeder with, it
+# only gets the data if the peer saved to state/peers is reconnected.
+#
+# Usage: tests/loopback_peers.sh [path to btfsng, build/btfsng by default]
+
+BTFSNG="$(readlink -f "${1:-build/btfsng}")"
+. "$(dirname "$0")/common.sh"
+
+make_torrent 8
+start_seeder
+
+mount_btfsng "$(seeder_magnet)"
+timeout "$TIMEOUT" cmp "$WORK/seed/data.bin" "$WORK/mnt/data.bin" || fail "first mount: couldn't read the data"
+unmount_btfsng
+
+PEERS="$WORK/path/state/peers/$HASH"
+[ -f "$PEERS" ] || fail "$PEERS wasn't saved"
+grep -qx "127.0.0.1 $PORT" "$PEERS" || fail "the seeder isn't in $PEERS"
+[ ! -e "$WORK/path/files/data.bin" ] || fail "the downloaded data wasn't deleted"
+
+mount_btfsng "$WORK/data.torrent"
+timeout "$TIMEOUT" cmp "$WORK/seed/data.bin" "$WORK/mnt/data.bin" || fail "second mount: couldn't read the data"
+unmount_btfsng
+
+echo "OK: reconnected to the saved peer"
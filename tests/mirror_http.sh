@@ -0,0 +1,51 @@
+#!/bin/sh
+# HTTP mirror test and time to first byte benchmark. First the whole file is read
+# with a local HTTP server as the only source, given with --mirror for that
+# torrent. Then reads at a few offsets are timed from a slow local seeder alone
+# and from the same seeder with the mirror added.
+#
+# Usage: tests/mirror_http.sh [path to btfsng, build/btfsng by default]
+# SEED_RATE (kB/s, 256 by default) is the seeder's upload limit.
+
+BTFSNG="$(readlink -f "${1:-build/btfsng}")"
+. "$(dirname "$0")/common.sh"
+
+SEED_RATE=${SEED_RATE:-256}
+
+make_torrent 32
+start_mirror
+
+mount_btfsng "$WORK/data.torrent" --mirror="$WORK/data.torrent=$(mirror_url)"
+timeout "$TIMEOUT" cmp "$WORK/seed/data.bin" "$WORK/mnt/data.bin" || fail "couldn't read the data from the mirror"
+unmount_btfsng
+echo "OK: read everything from the mirror"
+
+# times 64 KiB reads at 8 offsets spread over the file
+read_offsets() {
+  timeout "$TIMEOUT" python3 - "$WORK/mnt/data.bin" <<'EOF' || fail "reads took too long"
+import os, sys, time
+path = sys.argv[1]
+size = os.path.getsize(path)
+waits = []
+with open(path, "rb") as f:
+    for i in range(8):
+        f.seek(size * i // 8)
+        started = time.monotonic()
+        f.read(64 * 1024)
+        waits.append((time.monotonic() - started) * 1000)
+print("first byte %.1f ms, slowest read %.1f ms, 8 reads %.1f ms" % (waits[0], max(waits), sum(waits)))
+EOF
+}
+
+start_seeder "$SEED_RATE"
+MAGNET="$(seeder_magnet)"
+for run in swarm mirror; do
+  if [ "$run" = mirror ]; then
+    mount_btfsng "$MAGNET" --mirror="$MAGNET=$(mirror_url)"
+  else
+    mount_btfsng "$MAGNET"
+  fi
+  printf '%-7s ' "$run:"
+  read_offsets
+  unmount_btfsng
+done